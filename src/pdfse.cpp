@@ -3,40 +3,226 @@
 #include <iostream>
 #include <cstdlib>
 #include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <ctime>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <map>
+#include <regex>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <zlib.h>
 #include <podofo/podofo.h>
 #include "getopt_pp.h"
+#include "sha256.h"
 
 using namespace std;
 using namespace PoDoFo;
 
 const PdfName NONE_COLOR("None");
+// part of every cache key, bump when the plate output changes
+const string PDFSE_VERSION("1.13");
 
 struct SPOT {
     string name;
     string csId;
 };
 
+enum PLATE_KIND { PLATE_SPOT, PLATE_PROCESS, PLATE_REMAINING };
+
+struct OUTPUT {
+    string dir;             // empty: next to the input file
+    string nameTemplate;
+    bool toArchive;         // all plates as one tar stream on stdout
+    bool compact;           // object streams and a cross reference stream
+    bool linearize;         // first page up front with hint tables, for fast web view
+    bool progress;          // NDJSON events on stderr
+};
+
+struct CACHE {
+    string dir;             // empty: caching disabled
+    string inputKey;        // digest of the input bytes, the page range and PDFSE_VERSION
+};
+
 
 void HelpMsg()
 {
     cout << endl << "Usage:"
 	 << endl << " pdfse input_file.pdf [-options] Spot1 [ ... SpotN ]"
 	 << endl << endl
+	 << "Spots are matched case-insensitively, names with * or ? are wildcards"
+	 << endl << "and re:<regex> selects all spots matching the regular expression."
+	 << endl << endl
 	 << "Options:"
-         << endl << "  -d, --debug    enable Debug mode."
+         << endl << "  -d, --debug              enable Debug mode."
+         << endl << "  -o, --output-dir DIR     write plates to DIR instead of next to the input."
+         << endl << "  -n, --name TEMPLATE      plate file name, {input} and {plate} are replaced"
+         << endl << "                           (default: {input}.{plate}.pdf)."
+         << endl << "  -t, --tar                stream all plates as one tar archive to stdout."
+         << endl << "  -x, --compact            pack objects into compressed object streams (PDF 1.5)."
+         << endl << "  -w, --linearize          linearize the plates for fast web view."
+         << endl << "  -c, --cache DIR          reuse inventories, pages and plates of earlier runs."
+         << endl << "  -s, --spots SPOT ...     spots to separate, same as the trailing arguments."
+         << endl << "  -p, --process            also create Cyan, Magenta, Yellow and Black plates."
+         << endl << "  -r, --pages RANGE        only these pages, e.g. 3-5,10,12- (first page is 1)."
+         << endl << "  -l, --list               list the spots and the pages they are painted on."
+         << endl << "  -L, --layers             write one file with every plate as a layer,"
+         << endl << "                           {plate} is \"layers\" in its name."
+         << endl << "  -P, --progress           report pages and files as JSON lines on stderr."
+         << endl << "  -T, --timeout SECONDS    give up when the run takes longer."
+         << endl << "  -M, --memory-limit MB    give up when the heap needs more than MB, address"
+         << endl << "                           space reserved and written files are not counted."
+         << endl << "  -m, --max-memory MB      run only as much in parallel as fits in MB."
+         << endl << "  -a, --coverage           estimate the ink coverage of each plate per page,"
+         << endl << "                           written as JSON named for the plate \"coverage\"."
+         << endl << "  -k, --split K            write each plate in files of K pages, as soon as"
+         << endl << "                           they are separated, {plate} gets the pages: Gold.p1-4."
          << endl << endl;
 }
 
-inline bool ends_with(string const &value, string const &ending)
+// The signal that asked the run to stop, 0 while it goes on. SIGALRM is the
+// --timeout alarm.
+volatile sig_atomic_t stopRequested = 0;
+
+void RequestStop( int sig )
+{
+    stopRequested = sig;
+}
+
+class JobStopped : public exception
+{
+public:
+    explicit JobStopped( int number ) : sig(number) {}
+    const char *what() const noexcept
+    {
+        return (sig == SIGALRM) ? "time limit reached" : "cancelled";
+    }
+
+    int sig;
+};
+
+inline void CheckStop()
+// Cancellation point of the long loops. The exception fails the page at hand
+// and drains the pipeline like any other error, later pages fail right away.
+{
+    if (stopRequested)
+        throw JobStopped( stopRequested );
+}
+
+class MemoryBudget
+// With --max-memory: the estimated bytes of the work in flight, for the whole
+// process. Acquire() waits while a task would not fit next to the tasks
+// running and what is reserved for the document and the finished plate
+// pages. A task is let in whenever nothing else runs, so work that does not
+// fit goes on one task at a time instead of failing.
+{
+public:
+    MemoryBudget() : m_limit(0), m_reserved(0), m_used(0) {}
+
+    void SetLimit( size_t limit ) { m_limit = limit; }
+    size_t Limit() const { return m_limit; }
+
+    // held outside any task, such as the document and the finished plate pages
+    void Reserve( size_t bytes )
+    {
+        lock_guard<mutex> lock( m_mutex );
+        m_reserved += bytes;
+    }
+
+    void Unreserve( size_t bytes )
+    {
+        if (!bytes)
+            return;
+        lock_guard<mutex> lock( m_mutex );
+        m_reserved -= min(bytes, m_reserved);
+        m_fits.notify_all();
+    }
+
+    // the bytes to Release() later, 0 without a budget
+    size_t Acquire( size_t bytes )
+    {
+        if (!m_limit)
+            return 0;
+        unique_lock<mutex> lock( m_mutex );
+        m_fits.wait( lock, [&]() { return (m_used == 0) || (m_reserved + m_used + bytes <= m_limit); } );
+        m_used += bytes;
+        return bytes;
+    }
+
+    void Release( size_t bytes )
+    {
+        if (!bytes)
+            return;
+        lock_guard<mutex> lock( m_mutex );
+        m_used -= bytes;
+        m_fits.notify_all();
+    }
+
+private:
+    size_t m_limit;
+    size_t m_reserved;
+    size_t m_used;
+    mutex m_mutex;
+    condition_variable m_fits;
+};
+
+MemoryBudget memoryBudget;
+
+string JsonString( const string &value )
+{
+    ostringstream json;
+    json << '"';
+    for ( unsigned char c : value )
+    {
+        if ( (c == '"') || (c == '\\') )
+            json << '\\' << c;
+        else if (c < 0x20)
+            json << "\\u" << hex << setw(4) << setfill('0') << static_cast<int>(c) << dec;
+        else
+            json << c;
+    }
+    json << '"';
+    return json.str();
+}
+
+void Progress( const OUTPUT &output, const char *event, const string &fields = string() )
+// With --progress, one JSON object per line on stderr for job servers
+{
+    if (!output.progress)
+        return;
+    cerr << "{\"event\": \"" << event << "\"" << (fields.empty() ? "" : ", ") << fields << "}" << endl;
+}
+
+inline bool iends_with(string const &value, string const &ending)
 {
     if (ending.size() > value.size()) return false;
-    return equal(ending.rbegin(), ending.rend(), value.rbegin());
+    return equal(ending.rbegin(), ending.rend(), value.rbegin(),
+                 [](char a, char b) { return tolower(a) == tolower(b); });
 }
 
-void WriteArgumentsAndKeyword( vector<PdfVariant> &rArgs, const char* pszKeyword, PdfOutputDevice &rDevice )
+void WriteOperator( const vector<PdfVariant> &rArgs, const char* pszKeyword, PdfOutputDevice &rDevice )
 {
     vector<PdfVariant>::const_iterator it = rArgs.begin();
     while(it != rArgs.end())
@@ -45,8 +231,6 @@ void WriteArgumentsAndKeyword( vector<PdfVariant> &rArgs, const char* pszKeyword
         ++it;
     }
     
-    rArgs.clear();
-    
     if (pszKeyword) 
     {
         rDevice.Write(" ", 1);
@@ -94,276 +278,5388 @@ vector<PdfReference> GetColorRefs( const PdfMemDocument &pdf )
     return colorRefs;
 }
 
-string CreateSpaces ( string &name )
-// Converts #20 sequences to spaces
+string UnescapeName ( const string &name )
+// Decodes all #xx sequences of an escaped PDF name
+{
+    string unescaped;
+    unescaped.reserve(name.size());
+    for ( size_t i = 0; i < name.size(); ++i )
+    {
+        if ( (name[i] == '#') && (i + 2 < name.size())
+             && isxdigit(static_cast<unsigned char>(name[i + 1]))
+             && isxdigit(static_cast<unsigned char>(name[i + 2])) )
+        {
+            unescaped += static_cast<char>(stoi(name.substr(i + 1, 2), NULL, 16));
+            i += 2;
+        }
+        else
+            unescaped += name[i];
+    }
+    return unescaped;
+}
+
+unsigned int FoldCodePoint( unsigned int c )
+// Simple case folding for the scripts seen in spot names: Latin, Greek and Cyrillic
 {
-  string nameWithSpaces(name);
-  while ( nameWithSpaces.find("#20") != std::string::npos )
-      nameWithSpaces.replace ( nameWithSpaces.find("#20"), 3, " " );
-  return nameWithSpaces;
+    if (c < 0x80)
+        return ((c >= 'A') && (c <= 'Z')) ? c + 32 : c;
+    if ( (c >= 0xC0) && (c <= 0xDE) && (c != 0xD7) )
+        return c + 32;
+    if ( (c >= 0x100) && (c <= 0x17F) )
+    {
+        if ( (c == 0x130) || (c == 0x138) || (c == 0x149) || (c == 0x17F) )
+            return c;
+        if (c == 0x178)
+            return 0xFF;
+        bool odd_upper = ((c >= 0x139) && (c <= 0x148)) || ((c >= 0x179) && (c <= 0x17E));
+        if (odd_upper)
+            return (c % 2) ? c + 1 : c;
+        return (c % 2) ? c : c + 1;
+    }
+    if ( (c >= 0x391) && (c <= 0x3AB) && (c != 0x3A2) )
+        return c + 32;
+    if ( (c >= 0x400) && (c <= 0x40F) )
+        return c + 80;
+    if ( (c >= 0x410) && (c <= 0x42F) )
+        return c + 32;
+    return c;
 }
 
-bool caseInsensitiveStringCompare(const string& str1, const string& str2)
+string FoldCase( const string &name )
+// Case folded UTF-8 key of a spot name. Names that are not valid UTF-8 are
+// taken as Latin-1, as written by older applications
 {
-    if (str1.size() != str2.size()) 
+    vector<unsigned int> codes;
+    bool utf8 = true;
+    for ( size_t i = 0; (i < name.size()) && utf8; )
     {
-        return false;
+        unsigned char c = name[i];
+        int extra = (c < 0x80) ? 0 : ((c & 0xE0) == 0xC0) ? 1 : ((c & 0xF0) == 0xE0) ? 2 : ((c & 0xF8) == 0xF0) ? 3 : -1;
+        if ( (extra < 0) || (i + extra >= name.size()) )
+        {
+            utf8 = false;
+            break;
+        }
+        unsigned int code = extra ? (c & (0x3F >> extra)) : c;
+        for ( int k = 1; k <= extra; ++k )
+        {
+            unsigned char cc = name[i + k];
+            if ((cc & 0xC0) != 0x80)
+                utf8 = false;
+            code = (code << 6) | (cc & 0x3F);
+        }
+        codes.push_back(code);
+        i += extra + 1;
+    }
+    if (!utf8)
+    {
+        codes.clear();
+        for ( unsigned char c : name )
+            codes.push_back(c);
+    }
+
+    string folded;
+    for ( unsigned int code : codes )
+    {
+        code = FoldCodePoint(code);
+        if (code < 0x80)
+            folded += static_cast<char>(code);
+        else if (code < 0x800)
+        {
+            folded += static_cast<char>(0xC0 | (code >> 6));
+            folded += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000)
+        {
+            folded += static_cast<char>(0xE0 | (code >> 12));
+            folded += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            folded += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else
+        {
+            folded += static_cast<char>(0xF0 | (code >> 18));
+            folded += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            folded += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            folded += static_cast<char>(0x80 | (code & 0x3F));
+        }
     }
-    for (string::const_iterator c1 = str1.begin(), c2 = str2.begin(); c1 != str1.end(); ++c1, ++c2) 
+    return folded;
+}
+
+bool GlobMatch( const char *pattern, const char *text )
+// '*' matches any run of characters, '?' a single one
+{
+    const char *star = NULL, *resume = NULL;
+    while (*text)
     {
-        if (tolower(*c1) != tolower(*c2)) 
+        if ( (*pattern == '?') || ((*pattern == *text) && (*pattern != '*')) )
+        {
+            ++pattern;
+            ++text;
+        }
+        else if (*pattern == '*')
         {
+            star = pattern++;
+            resume = text;
+        }
+        else if (star)
+        {
+            pattern = star + 1;
+            text = ++resume;
+        }
+        else
             return false;
+    }
+    while (*pattern == '*')
+        ++pattern;
+    return *pattern == '\0';
+}
+
+void SelectSpots( const vector<SPOT> &spotsList, const vector<string> &requested, vector<SPOT> &selected, ostream &log )
+// Resolves the requested names against the inventory. Plain names are looked
+// up in a map of case folded names built once, "re:<regex>" and names with
+// '*' or '?' are matched against every spot. Each spot is selected once.
+{
+    unordered_map<string, size_t> byName;
+    vector<string> folded;
+    for ( size_t i = 0; i < spotsList.size(); ++i )
+    {
+        folded.push_back( FoldCase(spotsList[i].name) );
+        byName.insert( make_pair(folded.back(), i) );
+    }
+
+    vector<bool> taken(spotsList.size(), false);
+    for ( const string &request : requested )
+    {
+        vector<size_t> matches;
+        if (request.compare(0, 3, "re:") == 0)
+        {
+            regex re( request.substr(3), regex::ECMAScript | regex::icase );
+            for ( size_t i = 0; i < spotsList.size(); ++i )
+                if (regex_search(spotsList[i].name, re))
+                    matches.push_back(i);
+        }
+        else if (request.find_first_of("*?") != string::npos)
+        {
+            string pattern = FoldCase(UnescapeName(request));
+            for ( size_t i = 0; i < spotsList.size(); ++i )
+                if (GlobMatch(pattern.c_str(), folded[i].c_str()))
+                    matches.push_back(i);
+        }
+        else
+        {
+            unordered_map<string, size_t>::const_iterator it = byName.find( FoldCase(UnescapeName(request)) );
+            if (it != byName.end())
+                matches.push_back(it->second);
+        }
+
+        if (matches.empty())
+            log << "  no spot matches \"" << request << "\"" << endl;
+        for ( size_t i : matches )
+        {
+            if (taken[i])
+                continue;
+            taken[i] = true;
+            selected.push_back(spotsList[i]);
         }
     }
-    return true;
 }
 
-void RemoveObjectsExcept( const char *filename, struct SPOT *sp, vector<SPOT> *spotList )
+// Size of the chunks handed to pwrite() when the output can not be mapped
+const size_t WRITE_CHUNK_SIZE = 8 << 20;
+
+mode_t NewFileMode()
+// The mode open() gives a new file, mkstemp makes its files 0600. Read once
+// before any thread starts, the umask can only be read by setting it.
 {
-    // load input PDF file
-    PdfMemDocument pdf(filename);
+    mode_t mask = umask(0);
+    umask(mask);
+    return 0666 & ~mask;
+}
 
-    for( int page_num = 0; page_num < pdf.GetPageCount(); page_num++ )
+const mode_t NEW_FILE_MODE = NewFileMode();
+
+string PdfVersionString( EPdfVersion version )
+{
+    return "1." + to_string( static_cast<int>(version) - static_cast<int>(ePdfVersion_1_0) );
+}
+
+void WriteFileAtomic( const string &path, const char *data, size_t size )
+// Writes data to a temporary file next to path and renames it into place,
+// so watchers of the output directory never see a partial file
+{
+    string tmp_path = path + ".XXXXXX";
+    vector<char> tmp_name(tmp_path.begin(), tmp_path.end());
+    tmp_name.push_back('\0');
+    int fd = mkstemp(&tmp_name[0]);
+    if (fd < 0)
+        PODOFO_RAISE_ERROR_INFO( ePdfError_FileNotFound, path.c_str() );
+
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pwrite(fd, data + done, min(WRITE_CHUNK_SIZE, size - done), done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            close(fd);
+            unlink(&tmp_name[0]);
+            PODOFO_RAISE_ERROR_INFO( ePdfError_InvalidHandle, path.c_str() );
+        }
+        done += n;
+    }
+    if ( (fchmod(fd, NEW_FILE_MODE) != 0) || (fsync(fd) != 0) || (close(fd) != 0)
+         || (rename(&tmp_name[0], path.c_str()) != 0) )
+    {
+        unlink(&tmp_name[0]);
+        PODOFO_RAISE_ERROR_INFO( ePdfError_InvalidHandle, path.c_str() );
+    }
+}
+
+string CachePath( const CACHE &cache, const string &key, const char *ext )
+// Entries are spread over 256 sub directories by the first key byte
+{
+    return cache.dir + "/" + key.substr(0, 2) + "/" + key + ext;
+}
+
+bool CacheLoad( const CACHE &cache, const string &key, const char *ext, string &data )
+{
+    if (cache.dir.empty())
+        return false;
+    ifstream in( CachePath(cache, key, ext).c_str(), ios::binary );
+    if (!in)
+        return false;
+    ostringstream content;
+    content << in.rdbuf();
+    data = content.str();
+    return true;
+}
+
+void CacheStore( const CACHE &cache, const string &key, const char *ext, const char *data, size_t size )
+// A failing cache never fails the job, the entry is just not stored
+{
+    if (cache.dir.empty())
+        return;
+    mkdir(cache.dir.c_str(), 0755);
+    mkdir((cache.dir + "/" + key.substr(0, 2)).c_str(), 0755);
+    try
     {
-        PdfPage* pPage = pdf.GetPage( page_num );
-        PODOFO_RAISE_LOGIC_IF( !pPage, "Got null page pointer within valid page range" );
-
-	EPdfContentsType t;
-    	const char* pszKeyword;
-    	PdfVariant var;
-    	bool bReadToken;
-
-    	PdfContentsTokenizer tokenizer( pPage );
-    	vector<PdfVariant> args;
-	PdfRefCountedBuffer buffer;
-    	PdfOutputDevice device( &buffer );
-
-	bool is_need_del = true;
-    	bool is_inside_path = false;
-        string cur_cs_name = "";
-	bool inside_text = false;
-
-    	while( (bReadToken = tokenizer.ReadNext(t, pszKeyword, var)) )
-    	{
-	    if (t == ePdfContentsType_Variant)
-	    {
-		args.push_back(var);
-	    }
-	    else if (t == ePdfContentsType_ImageData) 
-	    {
-		args.push_back(var);
-	    }
-	    else if (t == ePdfContentsType_Keyword)
-	    {
-		if ( (strcmp(pszKeyword, "Do") == 0) && (spotList == NULL) ) // removing raster objects
-		{
-		    pszKeyword = "\0";
-		    args.clear();
-		    WriteArgumentsAndKeyword(args, pszKeyword, device);
-		    continue;
-		}
-
-		// removing text
-		if (spotList == NULL)
-		{
-		    if ( strcmp(pszKeyword, "BT") == 0 )
-		        inside_text = true;
-		    if (inside_text)
-		    {
-			if ( strcmp(pszKeyword, "ET") == 0 )
-			    inside_text = false;
-
-			pszKeyword = "\0";
-			args.clear();
-			WriteArgumentsAndKeyword(args, pszKeyword, device);
-			continue;
-		    }
-		}
-
-		if ((strcmp(pszKeyword, "cs") == 0) || (strcmp(pszKeyword, "CS") == 0) ||
-			(strcmp(pszKeyword, "scn") == 0) || (strcmp(pszKeyword, "SCN") == 0) ||
-			(strcmp(pszKeyword, "sc") == 0) || (strcmp(pszKeyword, "SC") == 0)
-			)
-		{
-		    // the spots
-		    //cout << pszKeyword << endl;
-        	    if ((strcmp(pszKeyword, "cs") == 0) || (strcmp(pszKeyword, "CS") == 0))
-        	    {
-            		if (args[0].IsName())
-                	{
-			    cur_cs_name = args[0].GetName().GetEscapedName();
-			    //cout << cur_cs_name << endl;
-			}
-            		if (spotList == NULL)
-                	    is_need_del = (cur_cs_name.compare(sp->csId) != 0);
-            		else // sp == NULL
-            		{
-                	    is_need_del = false;
-                	    for ( struct SPOT el : *spotList )
-                	    {
-                    		if (cur_cs_name.compare(el.csId) == 0)
-                    		{
-                        	    is_need_del = true;
-                        	    break;
-                    		}
-                	    }
-            		}
-        	    }
-		    WriteArgumentsAndKeyword(args, pszKeyword, device);
-		    continue;
-		}
-		if ((strcmp(pszKeyword, "k") == 0) || (strcmp(pszKeyword, "K") == 0))
-		{
-		    // cmyk vector graphics
-		    is_need_del = (spotList == NULL);
-		    WriteArgumentsAndKeyword(args, pszKeyword, device);
-		    continue;
-		}
-
-		// inside path checking
-		if ( (strcmp(pszKeyword, "m") == 0) || (strcmp(pszKeyword, "re") == 0) )
-		{
-		    is_inside_path = true;
-		}
-
-		bool confirm_del = false;
-		if (is_need_del && is_inside_path)
-		    confirm_del = true;
-		
-		if ((strcmp(pszKeyword, "S") == 0) ||
-		    (strcmp(pszKeyword, "s") == 0) ||
-		    (strcmp(pszKeyword, "f") == 0) ||
-		    (strcmp(pszKeyword, "F") == 0) ||
-		    (strcmp(pszKeyword, "f*") == 0) ||
-		    (strcmp(pszKeyword, "B") == 0) ||
-		    (strcmp(pszKeyword, "B*") == 0) ||
-		    (strcmp(pszKeyword, "b") == 0) ||
-		    (strcmp(pszKeyword, "b*") == 0) ||
-		    (strcmp(pszKeyword, "n") == 0))
-		{
-		    is_inside_path = false;
-		}
-		if (confirm_del)
-		{
-		    pszKeyword = "\0";
-		    args.clear();
-		    WriteArgumentsAndKeyword(args, pszKeyword, device);
-		    continue;
-		}
-
-		// for all others
-		WriteArgumentsAndKeyword( args, pszKeyword, device );
-	    }
-	}
-
-	// Write arguments if there are any left
-	WriteArgumentsAndKeyword( args, NULL, device );
-	// Set new contents stream
-	pPage->GetContentsForAppending()->GetStream()->Set( buffer.GetBuffer(), buffer.GetSize() );
-    }
-    string tmp_el = filename;
-    if (spotList == NULL)
-        tmp_el.replace(tmp_el.rfind(".pdf"), sizeof(".pdf"), "." + sp->name + ".pdf");
+        WriteFileAtomic( CachePath(cache, key, ext), data, size );
+    }
+    catch ( PdfError & )
+    {
+    }
+}
+
+string PlateCacheKey( const CACHE &cache, PLATE_KIND kind, const string &name, const string &csId,
+                      const vector<SPOT> &selection )
+// Spot and process plates depend on their own color only, the remaining
+// plate on the whole selection
+{
+    string spec = cache.inputKey;
+    if (kind == PLATE_SPOT)
+        spec += "\nspot\n" + csId + "\n" + name;
+    else if (kind == PLATE_PROCESS)
+        spec += "\nprocess\n" + name;
     else
-        tmp_el.replace(tmp_el.rfind(".pdf"), sizeof(".pdf"), ".remaining.pdf");
+    {
+        vector<string> ids;
+        for ( const SPOT &el : selection )
+            ids.push_back(el.csId);
+        sort(ids.begin(), ids.end());
+        spec += "\nremaining";
+        for ( const string &id : ids )
+            spec += "\n" + id;
+    }
+    return Sha256Hex(spec);
+}
 
-    pdf.Write( tmp_el.c_str() );
+string PlateFileKey( const string &plateKey, const OUTPUT &output )
+// Whole plates are cached per writer layout, the pages they are made of are not
+{
+    return Sha256Hex( plateKey + "\nwriter\n" + (output.compact ? "compact" : output.linearize ? "linear" : "classic") );
 }
 
-void MakeSpotList(const char *filename, vector<SPOT> &spotsList)
+struct LINEAR_PIECE {
+    string text;                    // an object up to its stream data, or a table
+    PdfObject *stream;              // its data follows the text, NULL for none
+};
+
+struct PLATE_LAYOUT {
+    EPdfWriteMode mode;
+    string header;
+    vector<PdfObject*> objects;     // written as they are
+    vector<string> packed;          // object streams, compact layout only
+    string xref;                    // table and "trailer", or the whole xref stream object
+    bool xrefStream;                // compact layout
+    PdfDictionary trailer;          // classic layout only
+    string tail;
+    vector<LINEAR_PIECE> linear;    // linearized layout: everything after the header
+    size_t size;
+};
+
+void CollectReferences( PdfVecObjects &objects, vector<const PdfObject*> &pending,
+                        const unordered_set<PdfObject*> &stops, vector<PdfObject*> &found )
+// Objects referred to from pending, directly or through others, in the
+// order they are found. Objects in stops are neither taken nor followed.
 {
-    PdfMemDocument pdf(filename);
-    vector<PdfReference> colorRefs = GetColorRefs(pdf);
-    int i=0;
-    std::vector<PdfReference>::iterator it = colorRefs.begin();
-    while ( it != colorRefs.end() )
+    unordered_set<PdfObject*> seen( stops );
+    while ( !pending.empty() )
     {
-        if ( pdf.GetObjects().GetObject(*it)->IsArray() )
+        const PdfObject *value = pending.back();
+        pending.pop_back();
+        if (value->IsReference())
         {
-            PdfArray colorArray = pdf.GetObjects().GetObject(*it)->GetArray();
-            if ( (colorArray.GetSize() > 1)
-                 && colorArray[0].IsName()
-                 && (colorArray[0].GetName().GetEscapedName() == "Separation")
-                 && colorArray[1].IsName() )
+            PdfObject *obj = objects.GetObject(value->GetReference());
+            if ( obj && seen.insert(obj).second )
             {
-                struct SPOT el;
-                el.name = colorArray[1].GetName().GetEscapedName();
-                el.name = CreateSpaces(el.name);
-                el.csId = "CS" + to_string(i);
-                spotsList.push_back(el);
+                found.push_back(obj);
+                pending.push_back(obj);
             }
         }
-        ++it;
-        ++i;
+        else if (value->IsDictionary())
+        {
+            for ( const auto &entry : value->GetDictionary().GetKeys() )
+                pending.push_back(entry.second);
+        }
+        else if (value->IsArray())
+        {
+            const PdfArray &array = value->GetArray();
+            for ( size_t i = 0; i < array.GetSize(); ++i )
+                pending.push_back(&array[i]);
+        }
     }
 }
 
-int main( int argc, char* argv[] )
+void ReachableObjects( PdfMemDocument &pdf, vector<PdfObject*> &reachable )
+// Objects a plate can reach from its trailer. Fonts, images and color spaces
+// only used by content that was removed are not reachable any more.
 {
-    GetOpt::GetOpt_pp cmd(argc, argv);
+    vector<const PdfObject*> pending;
+    const char *roots[] = { "Root", "Info" };
+    for ( const char *key : roots )
+    {
+        const PdfObject *root = pdf.GetTrailer()->GetDictionary().GetKey(key);
+        if (root)
+            pending.push_back(root);
+    }
+    CollectReferences( pdf.GetObjects(), pending, unordered_set<PdfObject*>(), reachable );
+}
 
-    // must be at least one Spot
-    if (argc < 3)
+void DeflateBatches( vector<string> &batches )
+// Object streams do not depend on each other, they are compressed in parallel
+{
+    atomic<size_t> next(0);
+    atomic<bool> failed(false);
+    auto worker = [&]()
     {
-	HelpMsg();
-	return 0;
+        for ( size_t i = next++; i < batches.size(); i = next++ )
+        {
+            // the output buffer and zlib's own state
+            uLongf size = compressBound(batches[i].size());
+            size_t held = memoryBudget.Acquire( size + (256 << 10) );
+            string deflated(size, '\0');
+            int result = compress2(reinterpret_cast<Bytef*>(&deflated[0]), &size,
+                                   reinterpret_cast<const Bytef*>(batches[i].data()), batches[i].size(),
+                                   Z_DEFAULT_COMPRESSION);
+            if (result == Z_OK)
+            {
+                deflated.resize(size);
+                batches[i].swap(deflated);
+            }
+            string().swap(deflated);
+            memoryBudget.Release( held );
+            if (result != Z_OK)
+            {
+                failed = true;
+                return;
+            }
+        }
+    };
+
+    size_t workers = min<size_t>(max(thread::hardware_concurrency(), 1u), batches.size());
+    vector<thread> threads;
+    for ( size_t i = 1; i < workers; ++i )
+        threads.emplace_back(worker);
+    worker();
+    for ( thread &t : threads )
+        t.join();
+    if (failed)
+        PODOFO_RAISE_ERROR( ePdfError_Flate );
+}
+
+string StreamObject( pdf_objnum num, PdfDictionary dict, const string &data, EPdfWriteMode mode )
+// A complete indirect stream object for data that was deflated here
+{
+    dict.AddKey( PdfName::KeyFilter, PdfName("FlateDecode") );
+    dict.AddKey( PdfName::KeyLength, PdfObject(static_cast<pdf_int64>(data.size())) );
+    PdfRefCountedBuffer buffer;
+    PdfOutputDevice device( &buffer );
+    dict.Write( &device, mode );
+    return to_string(num) + " 0 obj\n" + string(buffer.GetBuffer(), device.GetLength())
+           + "\nstream\n" + data + "\nendstream\nendobj\n";
+}
+
+void LayoutCompact( PdfMemDocument &pdf, PLATE_LAYOUT &layout, pdf_objnum max_num, size_t pos )
+// PDF 1.5 layout: objects without a stream are packed into compressed object
+// streams and the cross reference table becomes a compressed xref stream
+{
+    const size_t BATCH = 100;
+    vector<PdfObject*> direct;
+    vector<vector<PdfObject*>> batches;
+    for ( PdfObject *obj : layout.objects )
+    {
+        if ( obj->HasStream() || (obj->Reference().GenerationNumber() != 0) )
+        {
+            direct.push_back(obj);
+            continue;
+        }
+        if ( batches.empty() || (batches.back().size() == BATCH) )
+            batches.push_back(vector<PdfObject*>());
+        batches.back().push_back(obj);
     }
+    layout.objects.swap(direct);
 
-    // get command line input parameters
-    vector<string> options;
-    cmd >> GetOpt::GlobalOption(options);
-	
-    // logging
-    bool is_log = false;
-    if ( cmd >> GetOpt::OptionPresent('d', "debug"))
-	is_log = true;
-    PdfError::EnableDebug(is_log);
-    PdfError::EnableLogging(is_log);
+    // object stream contents: "num offset" pairs, then the objects. They are
+    // serialised here, the document is not touched by the compressing threads.
+    vector<string> contents( batches.size() );
+    vector<size_t> firsts( batches.size() );
+    for ( size_t b = 0; b < batches.size(); ++b )
+    {
+        string header, body;
+        for ( PdfObject *obj : batches[b] )
+        {
+            header += to_string(obj->Reference().ObjectNumber()) + " " + to_string(body.size()) + " ";
+            PdfRefCountedBuffer buffer;
+            PdfOutputDevice device( &buffer );
+            obj->Write( &device, layout.mode );
+            body.append( buffer.GetBuffer(), device.GetLength() );
+            body += '\n';
+        }
+        firsts[b] = header.size();
+        contents[b] = header + body;
+    }
+    DeflateBatches( contents );
 
-    // STEP 1. Make list of all available spots
-    // load input PDF file
-    cout << "Preparing..." << endl;
-    vector<SPOT> spotsList;
-    MakeSpotList(options[0].c_str(), spotsList);
-    // get all spots from input parameters
-    vector<SPOT> spotsRemove;
-    string tempSpot, endPdf = ".pdf";
-    vector<string>::iterator iter = options.begin();
-    while ( iter != options.end() )
+    pdf_objnum size = max_num + 1 + batches.size() + 1;
+    pdf_objnum xref_num = size - 1;
+    // entry type, then offset or object stream, then generation or index
+    vector<uint64_t> field2( size, 0 );
+    vector<unsigned> field3( size, 0 );
+    vector<unsigned char> types( size, 0 );
+    field3[0] = 65535;
+    for ( PdfObject *obj : layout.objects )
+    {
+        pdf_objnum num = obj->Reference().ObjectNumber();
+        types[num] = 1;
+        field2[num] = pos;
+        field3[num] = obj->Reference().GenerationNumber();
+        pos += obj->GetObjectLength(layout.mode);
+    }
+    layout.packed.clear();
+    for ( size_t b = 0; b < batches.size(); ++b )
     {
-        if ( not ends_with(*iter, endPdf) )
+        pdf_objnum num = max_num + 1 + b;
+        for ( size_t i = 0; i < batches[b].size(); ++i )
         {
-            tempSpot = *iter;
-            struct SPOT el;
-            // searching
-            for ( struct SPOT sp : spotsList )
+            pdf_objnum packed_num = batches[b][i]->Reference().ObjectNumber();
+            types[packed_num] = 2;
+            field2[packed_num] = num;
+            field3[packed_num] = i;
+        }
+        PdfDictionary dict;
+        dict.AddKey( PdfName::KeyType, PdfName("ObjStm") );
+        dict.AddKey( "N", PdfObject(static_cast<pdf_int64>(batches[b].size())) );
+        dict.AddKey( "First", PdfObject(static_cast<pdf_int64>(firsts[b])) );
+        layout.packed.push_back( StreamObject(num, dict, contents[b], layout.mode) );
+        string().swap(contents[b]);
+
+        types[num] = 1;
+        field2[num] = pos;
+        pos += layout.packed.back().size();
+    }
+    size_t xref_offset = pos;
+    types[xref_num] = 1;
+    field2[xref_num] = xref_offset;
+
+    int width = (xref_offset > 0xFFFFFFFFu) ? 8 : 4;
+    string entries;
+    entries.reserve( size * (1 + width + 2) );
+    for ( pdf_objnum num = 0; num < size; ++num )
+    {
+        entries += static_cast<char>(types[num]);
+        for ( int shift = (width - 1) * 8; shift >= 0; shift -= 8 )
+            entries += static_cast<char>((field2[num] >> shift) & 0xFF);
+        entries += static_cast<char>((field3[num] >> 8) & 0xFF);
+        entries += static_cast<char>(field3[num] & 0xFF);
+    }
+    vector<string> xref_data( 1, entries );
+    DeflateBatches( xref_data );
+
+    PdfDictionary dict;
+    dict.AddKey( PdfName::KeyType, PdfName("XRef") );
+    dict.AddKey( "Size", PdfObject(static_cast<pdf_int64>(size)) );
+    PdfArray w;
+    w.push_back( PdfObject(static_cast<pdf_int64>(1)) );
+    w.push_back( PdfObject(static_cast<pdf_int64>(width)) );
+    w.push_back( PdfObject(static_cast<pdf_int64>(2)) );
+    dict.AddKey( "W", w );
+    const char *trailer_keys[] = { "Root", "Info", "ID" };
+    for ( const char *key : trailer_keys )
+    {
+        if (pdf.GetTrailer()->GetDictionary().HasKey(key))
+            dict.AddKey(key, *pdf.GetTrailer()->GetDictionary().GetKey(key));
+    }
+    layout.xref = StreamObject( xref_num, dict, xref_data[0], layout.mode );
+    layout.trailer.Clear();
+    layout.tail = "startxref\n" + to_string(xref_offset) + "\n%%EOF\n";
+    layout.size = xref_offset + layout.xref.size() + layout.tail.size();
+}
+
+const char LINEAR_STREAM_END[] = "\nendstream\nendobj\n";
+
+size_t PieceSize( const LINEAR_PIECE &piece )
+{
+    if (!piece.stream)
+        return piece.text.size();
+    return piece.text.size() + piece.stream->GetStream()->GetInternalBufferSize() + strlen(LINEAR_STREAM_END);
+}
+
+string PaddedOffset( size_t offset )
+// Offsets the linearization dictionary and the first page trailer give are
+// written at a fixed width, their values are only known once the sizes of
+// everything around them are
+{
+    char padded[21];
+    snprintf(padded, sizeof(padded), "%010lu", static_cast<unsigned long>(offset));
+    return padded;
+}
+
+PdfVariant RenumberReferences( const PdfVariant &value, const map<PdfReference, pdf_objnum> &numbers )
+// A copy of value referring to objects by their new numbers, references to
+// objects that are not written become null
+{
+    if (value.IsReference())
+    {
+        map<PdfReference, pdf_objnum>::const_iterator it = numbers.find(value.GetReference());
+        return (it == numbers.end()) ? PdfVariant() : PdfVariant(PdfReference(it->second, 0));
+    }
+    if (value.IsDictionary())
+    {
+        PdfDictionary dict;
+        for ( const auto &entry : value.GetDictionary().GetKeys() )
+            dict.AddKey( entry.first, PdfObject(RenumberReferences(*entry.second, numbers)) );
+        return PdfVariant(dict);
+    }
+    if (value.IsArray())
+    {
+        PdfArray array;
+        const PdfArray &original = value.GetArray();
+        for ( size_t i = 0; i < original.GetSize(); ++i )
+            array.push_back( PdfObject(RenumberReferences(original[i], numbers)) );
+        return PdfVariant(array);
+    }
+    return value;
+}
+
+LINEAR_PIECE LinearObject( PdfObject *obj, const map<PdfReference, pdf_objnum> &numbers, EPdfWriteMode mode )
+{
+    PdfVariant value = RenumberReferences( *obj, numbers );
+    LINEAR_PIECE piece = { to_string(numbers.at(obj->Reference())) + " 0 obj\n", NULL };
+    if (obj->HasStream())
+    {
+        piece.stream = obj;
+        value.GetDictionary().AddKey( PdfName::KeyLength,
+                                      PdfObject(static_cast<pdf_int64>(obj->GetStream()->GetInternalBufferSize())) );
+    }
+    PdfRefCountedBuffer buffer;
+    PdfOutputDevice device( &buffer );
+    value.Write( &device, mode );
+    piece.text.append( buffer.GetBuffer(), device.GetLength() );
+    piece.text += piece.stream ? "\nstream\n" : "\nendobj\n";
+    return piece;
+}
+
+void CollectPages( PdfVecObjects &objects, const PdfObject *node, vector<PdfObject*> &pages,
+                   unordered_set<PdfObject*> &tree )
+// Page objects in page order, tree gets them and the nodes above them
+{
+    if ( !node || !node->IsReference() )
+        return;
+    PdfObject *obj = objects.GetObject( node->GetReference() );
+    if ( !obj || !obj->IsDictionary() || !tree.insert(obj).second )
+        return;
+    const PdfObject *kids = obj->GetDictionary().GetKey( "Kids" );
+    if ( !kids || !kids->IsArray() )
+    {
+        pages.push_back(obj);
+        return;
+    }
+    for ( size_t i = 0; i < kids->GetArray().GetSize(); ++i )
+        CollectPages( objects, &kids->GetArray()[i], pages, tree );
+}
+
+class HintBits
+// The hint tables are packed bit fields, most significant bit first
+{
+public:
+    HintBits() : m_byte(0), m_count(0) {}
+
+    void Put( uint64_t value, int bits )
+    {
+        for ( int bit = bits - 1; bit >= 0; --bit )
+        {
+            m_byte = static_cast<unsigned char>((m_byte << 1) | ((value >> bit) & 1));
+            if (++m_count == 8)
             {
-                if ( caseInsensitiveStringCompare(sp.name, tempSpot) )
-                {
-                    el = sp;
-                    break;
-                }
+                m_data += static_cast<char>(m_byte);
+                m_byte = 0;
+                m_count = 0;
             }
-            spotsRemove.push_back(el);
         }
-        ++iter;
     }
 
-    // STEP 2. Making all Spots files
-    cout << "Creating files for selected spots..." << endl;
-    for ( struct SPOT sp : spotsRemove )
+    // every item of the per page and per object entries starts on a byte
+    void Align()
+    {
+        if (m_count)
+            Put( 0, 8 - m_count );
+    }
+
+    const string &Data()
     {
-        cout << "  " << sp.name << endl;
-        RemoveObjectsExcept(options[0].c_str(), &sp, NULL);
+        Align();
+        return m_data;
     }
 
-    // STEP 3. Create "<*>.remaining.pdf" file
-    cout << "Creating remaining file..." << endl;
-    struct SPOT el;
-    RemoveObjectsExcept(options[0].c_str(), &el, &spotsRemove);
+    static int BitsFor( uint64_t value )
+    {
+        int bits = 0;
+        for ( ; value; value >>= 1 )
+            ++bits;
+        return bits;
+    }
 
-    cout << "Done." << endl;
+private:
+    string m_data;
+    unsigned char m_byte;
+    int m_count;
+};
 
-    return 0;
+void LayoutLinear( PdfMemDocument &pdf, PLATE_LAYOUT &layout )
+// Linearized layout for fast web view, as in Annex F of the PDF reference:
+// the linearization dictionary, the first page cross reference section, the
+// catalog, the hint stream and everything the first page draws on come
+// first. The other pages follow one by one with the objects only they use,
+// then the objects pages share, then the rest. Objects are renumbered in
+// that order, the first page section takes the highest numbers.
+{
+    PdfVecObjects &objects = pdf.GetObjects();
+    const PdfDictionary &trailer = pdf.GetTrailer()->GetDictionary();
+    const PdfObject *root = trailer.GetKey( "Root" );
+    PdfObject *catalog = (root && root->IsReference()) ? objects.GetObject( root->GetReference() ) : NULL;
+    if ( !catalog || !catalog->IsDictionary() )
+        PODOFO_RAISE_ERROR_INFO( ePdfError_NoObject, "Plate has no catalog to linearize" );
+    vector<PdfObject*> pages;
+    unordered_set<PdfObject*> stops;
+    CollectPages( objects, catalog->GetDictionary().GetKey("Pages"), pages, stops );
+    if (pages.empty())
+        PODOFO_RAISE_ERROR_INFO( ePdfError_PageNotFound, "Plate has no pages to linearize" );
+    stops.insert(catalog);
+
+    // what each page draws on: not its parent, the catalog or other pages
+    vector<vector<PdfObject*>> used( pages.size() );
+    for ( size_t i = 0; i < pages.size(); ++i )
+    {
+        vector<const PdfObject*> pending;
+        for ( const auto &entry : pages[i]->GetDictionary().GetKeys() )
+        {
+            if (entry.first != PdfName("Parent"))
+                pending.push_back(entry.second);
+        }
+        CollectReferences( objects, pending, stops, used[i] );
+    }
+
+    unordered_set<PdfObject*> placed( pages.begin(), pages.end() );
+    placed.insert(catalog);
+    vector<PdfObject*> first( 1, pages[0] );
+    for ( PdfObject *obj : used[0] )
+    {
+        placed.insert(obj);
+        first.push_back(obj);
+    }
+    unordered_map<PdfObject*, size_t> users;
+    for ( size_t i = 1; i < pages.size(); ++i )
+    {
+        for ( PdfObject *obj : used[i] )
+            ++users[obj];
+    }
+    vector<PdfObject*> rest;        // pages after the first with their own objects, shared, others
+    vector<size_t> page_begin( pages.size(), 0 );
+    for ( size_t i = 1; i < pages.size(); ++i )
+    {
+        page_begin[i] = rest.size();
+        rest.push_back(pages[i]);
+        for ( PdfObject *obj : used[i] )
+        {
+            if ( (users[obj] == 1) && placed.insert(obj).second )
+                rest.push_back(obj);
+        }
+    }
+    size_t shared_begin = rest.size();
+    for ( size_t i = 1; i < pages.size(); ++i )
+    {
+        for ( PdfObject *obj : used[i] )
+        {
+            if (placed.insert(obj).second)
+                rest.push_back(obj);
+        }
+    }
+    size_t shared_end = rest.size();
+    vector<PdfObject*> reachable;
+    ReachableObjects( pdf, reachable );
+    for ( PdfObject *obj : reachable )
+    {
+        if (placed.insert(obj).second)
+            rest.push_back(obj);
+    }
+
+    map<PdfReference, pdf_objnum> numbers;
+    pdf_objnum num = 1;
+    for ( PdfObject *obj : rest )
+        numbers[obj->Reference()] = num++;
+    pdf_objnum linear_num = num++;
+    numbers[catalog->Reference()] = num++;
+    for ( PdfObject *obj : first )
+        numbers[obj->Reference()] = num++;
+    pdf_objnum hint_num = num++;
+    pdf_objnum size = num;
+
+    LINEAR_PIECE catalog_piece = LinearObject( catalog, numbers, layout.mode );
+    vector<LINEAR_PIECE> first_pieces, rest_pieces;
+    for ( PdfObject *obj : first )
+        first_pieces.push_back( LinearObject(obj, numbers, layout.mode) );
+    for ( PdfObject *obj : rest )
+        rest_pieces.push_back( LinearObject(obj, numbers, layout.mode) );
+
+    string id;
+    const PdfObject *id_value = trailer.GetKey( "ID" );
+    if (id_value)
+    {
+        PdfRefCountedBuffer buffer;
+        PdfOutputDevice device( &buffer );
+        id_value->Write( &device, layout.mode );
+        id = " /ID " + string(buffer.GetBuffer(), device.GetLength());
+    }
+    const PdfObject *info = trailer.GetKey( "Info" );
+    map<PdfReference, pdf_objnum>::const_iterator info_num
+        = (info && info->IsReference()) ? numbers.find(info->GetReference()) : numbers.end();
+
+    auto linear_dict = [&]( size_t file_size, size_t hint_offset, size_t hint_size, size_t first_end, size_t main_entry )
+    {
+        return to_string(linear_num) + " 0 obj\n<< /Linearized 1 /L " + PaddedOffset(file_size)
+               + " /H [ " + PaddedOffset(hint_offset) + " " + PaddedOffset(hint_size) + " ] /O "
+               + to_string(numbers[pages[0]->Reference()]) + " /E " + PaddedOffset(first_end)
+               + " /N " + to_string(pages.size()) + " /T " + PaddedOffset(main_entry) + " >>\nendobj\n";
+    };
+    auto first_xref = [&]( const vector<size_t> &offsets, size_t main_xref )
+    {
+        string xref = "xref\n" + to_string(linear_num) + " " + to_string(size - linear_num) + "\n";
+        char entry[21];
+        for ( size_t offset : offsets )
+        {
+            snprintf(entry, sizeof(entry), "%010lu %05u n\r\n", static_cast<unsigned long>(offset), 0u);
+            xref += entry;
+        }
+        xref += "trailer\n<< /Size " + to_string(size) + " /Root " + to_string(linear_num + 1) + " 0 R";
+        if (info_num != numbers.end())
+            xref += " /Info " + to_string(info_num->second) + " 0 R";
+        return xref + id + " /Prev " + PaddedOffset(main_xref) + " >>\nstartxref\n0\n%%EOF\n";
+    };
+    size_t linear_size = linear_dict(0, 0, 0, 0, 0).size();
+    size_t first_xref_size = first_xref(vector<size_t>(size - linear_num, 0), 0).size();
+
+    // offsets in the hint tables leave out the hint stream itself
+
+    size_t pos = layout.header.size() + linear_size + first_xref_size + PieceSize(catalog_piece);
+    vector<size_t> first_offsets, rest_offsets;
+    for ( const LINEAR_PIECE &piece : first_pieces )
+    {
+        first_offsets.push_back(pos);
+        pos += PieceSize(piece);
+    }
+    size_t first_end = pos;
+    for ( const LINEAR_PIECE &piece : rest_pieces )
+    {
+        rest_offsets.push_back(pos);
+        pos += PieceSize(piece);
+    }
+    rest_offsets.push_back(pos);
+
+    // page offset hint table: objects, length and shared objects per page.
+    // Shared objects are numbered through the first page section and then
+    // the shared objects section, each one a group of its own.
+    unordered_map<PdfObject*, size_t> shared_ids;
+    for ( size_t i = 0; i < first.size(); ++i )
+        shared_ids[first[i]] = i;
+    for ( size_t i = shared_begin; i < shared_end; ++i )
+        shared_ids[rest[i]] = first.size() + i - shared_begin;
+    vector<size_t> page_objects( pages.size() ), page_lengths( pages.size() );
+    vector<vector<size_t>> page_shared( pages.size() );
+    page_objects[0] = first.size();
+    page_lengths[0] = first_end - first_offsets[0];
+    for ( size_t i = 1; i < pages.size(); ++i )
+    {
+        size_t end = (i + 1 < pages.size()) ? page_begin[i + 1] : shared_begin;
+        page_objects[i] = end - page_begin[i];
+        page_lengths[i] = rest_offsets[end] - rest_offsets[page_begin[i]];
+        for ( PdfObject *obj : used[i] )
+        {
+            if (shared_ids.count(obj))
+                page_shared[i].push_back(shared_ids[obj]);
+        }
+    }
+    size_t min_objects = *min_element(page_objects.begin(), page_objects.end());
+    size_t min_length = *min_element(page_lengths.begin(), page_lengths.end());
+    int object_bits = HintBits::BitsFor( *max_element(page_objects.begin(), page_objects.end()) - min_objects );
+    int length_bits = HintBits::BitsFor( *max_element(page_lengths.begin(), page_lengths.end()) - min_length );
+    size_t max_shared = 0;
+    for ( const vector<size_t> &shared : page_shared )
+        max_shared = max(max_shared, shared.size());
+    int count_bits = HintBits::BitsFor( max_shared );
+    int id_bits = HintBits::BitsFor( first.size() + shared_end - shared_begin - 1 );
+
+    HintBits hints;
+    hints.Put( min_objects, 32 );
+    hints.Put( first_offsets[0], 32 );
+    hints.Put( object_bits, 16 );
+    hints.Put( min_length, 32 );
+    hints.Put( length_bits, 16 );
+    // content streams are given as the whole page, as Acrobat reads them
+    hints.Put( 0, 32 );
+    hints.Put( 0, 16 );
+    hints.Put( min_length, 32 );
+    hints.Put( length_bits, 16 );
+    hints.Put( count_bits, 16 );
+    hints.Put( id_bits, 16 );
+    hints.Put( 0, 16 );
+    hints.Put( 4, 16 );
+    for ( size_t i = 0; i < pages.size(); ++i )
+        hints.Put( page_objects[i] - min_objects, object_bits );
+    hints.Align();
+    for ( size_t i = 0; i < pages.size(); ++i )
+        hints.Put( page_lengths[i] - min_length, length_bits );
+    hints.Align();
+    for ( size_t i = 0; i < pages.size(); ++i )
+        hints.Put( page_shared[i].size(), count_bits );
+    hints.Align();
+    for ( size_t i = 0; i < pages.size(); ++i )
+    {
+        for ( size_t shared : page_shared[i] )
+            hints.Put( shared, id_bits );
+    }
+    hints.Align();
+    for ( size_t i = 0; i < pages.size(); ++i )
+        hints.Put( page_lengths[i] - min_length, length_bits );
+    size_t shared_table = hints.Data().size();
+
+    // shared object hint table: the length of each group
+    vector<size_t> group_lengths;
+    for ( size_t i = 0; i < first.size(); ++i )
+        group_lengths.push_back( ((i + 1 < first.size()) ? first_offsets[i + 1] : first_end) - first_offsets[i] );
+    for ( size_t i = shared_begin; i < shared_end; ++i )
+        group_lengths.push_back( rest_offsets[i + 1] - rest_offsets[i] );
+    size_t min_group = *min_element(group_lengths.begin(), group_lengths.end());
+    int group_bits = HintBits::BitsFor( *max_element(group_lengths.begin(), group_lengths.end()) - min_group );
+    bool any_shared = (shared_end > shared_begin);
+    hints.Put( any_shared ? numbers[rest[shared_begin]->Reference()] : 0, 32 );
+    hints.Put( any_shared ? rest_offsets[shared_begin] : 0, 32 );
+    hints.Put( first.size(), 32 );
+    hints.Put( group_lengths.size(), 32 );
+    hints.Put( 0, 16 );
+    hints.Put( min_group, 32 );
+    hints.Put( group_bits, 16 );
+    for ( size_t length : group_lengths )
+        hints.Put( length - min_group, group_bits );
+    hints.Align();
+    for ( size_t i = 0; i < group_lengths.size(); ++i )
+        hints.Put( 0, 1 );
+
+    vector<string> hint_data( 1, hints.Data() );
+    DeflateBatches( hint_data );
+    PdfDictionary hint_dict;
+    hint_dict.AddKey( "S", PdfObject(static_cast<pdf_int64>(shared_table)) );
+    LINEAR_PIECE hint_piece = { StreamObject(hint_num, hint_dict, hint_data[0], layout.mode), NULL };
+
+    // the real offsets, with the hint stream
+    size_t hint_offset = layout.header.size() + linear_size + first_xref_size + PieceSize(catalog_piece);
+    size_t hint_size = PieceSize(hint_piece);
+    size_t main_xref = rest_offsets.back() + hint_size;
+    string xref = "xref\n0 " + to_string(linear_num);
+    size_t main_first_entry = main_xref + xref.size();
+    xref += "\n0000000000 65535 f\r\n";
+    char entry[21];
+    for ( size_t i = 0; i < rest.size(); ++i )
+    {
+        snprintf(entry, sizeof(entry), "%010lu %05u n\r\n", static_cast<unsigned long>(rest_offsets[i] + hint_size), 0u);
+        xref += entry;
+    }
+    xref += "trailer\n<< /Size " + to_string(linear_num) + " >>\nstartxref\n"
+            + to_string(layout.header.size() + linear_size) + "\n%%EOF\n";
+    layout.size = main_xref + xref.size();
+
+    vector<size_t> offsets;         // of the first page section by object number
+    offsets.push_back(layout.header.size());
+    offsets.push_back(layout.header.size() + linear_size + first_xref_size);
+    for ( size_t offset : first_offsets )
+        offsets.push_back(offset + hint_size);
+    offsets.push_back(hint_offset);
+
+    layout.linear.clear();
+    LINEAR_PIECE linear_piece = { linear_dict(layout.size, hint_offset, hint_size, first_end + hint_size, main_first_entry), NULL };
+    layout.linear.push_back(linear_piece);
+    LINEAR_PIECE first_xref_piece = { first_xref(offsets, main_xref), NULL };
+    layout.linear.push_back(first_xref_piece);
+    layout.linear.push_back(catalog_piece);
+    layout.linear.push_back(hint_piece);
+    layout.linear.insert(layout.linear.end(), make_move_iterator(first_pieces.begin()),
+                         make_move_iterator(first_pieces.end()));
+    layout.linear.insert(layout.linear.end(), make_move_iterator(rest_pieces.begin()),
+                         make_move_iterator(rest_pieces.end()));
+    LINEAR_PIECE xref_piece = { xref, NULL };
+    layout.linear.push_back(xref_piece);
+}
+
+void LayoutPlate( PdfMemDocument &pdf, PLATE_LAYOUT &layout, const OUTPUT &output )
+// Computes object sizes up front, so the xref offsets and the total file
+// size are known before the first byte is written
+{
+    bool compact = output.compact;
+    layout.mode = pdf.GetWriteMode();
+    EPdfVersion version = pdf.GetPdfVersion();
+    if ( compact && (version < ePdfVersion_1_5) )
+        version = ePdfVersion_1_5;
+    layout.header = "%PDF-" + PdfVersionString(version) + "\n%\xE2\xE3\xCF\xD3\n";
+
+    pdf_objnum max_num = 0;
+    layout.objects.clear();
+    layout.packed.clear();
+    layout.linear.clear();
+    layout.xrefStream = compact;
+    if (output.linearize)
+    {
+        LayoutLinear( pdf, layout );
+        return;
+    }
+    ReachableObjects( pdf, layout.objects );
+    for ( PdfObject *obj : layout.objects )
+        max_num = max(max_num, obj->Reference().ObjectNumber());
+    sort(layout.objects.begin(), layout.objects.end(), [](const PdfObject *a, const PdfObject *b)
+         { return a->Reference().ObjectNumber() < b->Reference().ObjectNumber(); });
+
+    if (compact)
+    {
+        LayoutCompact( pdf, layout, max_num, layout.header.size() );
+        return;
+    }
+
+    vector<size_t> offsets(max_num + 1, 0);
+    vector<pdf_gennum> generations(max_num + 1, 0);
+    vector<bool> in_use(max_num + 1, false);
+    size_t pos = layout.header.size();
+    for ( PdfObject *obj : layout.objects )
+    {
+        pdf_objnum num = obj->Reference().ObjectNumber();
+        offsets[num] = pos;
+        generations[num] = obj->Reference().GenerationNumber();
+        in_use[num] = true;
+        pos += obj->GetObjectLength(layout.mode);
+    }
+    size_t xref_offset = pos;
+
+    // cross reference table, free entries are chained through their offset field
+    layout.xref = "xref\n0 " + to_string(max_num + 1) + "\n";
+    char entry[21];
+    for ( pdf_objnum num = 0; num <= max_num; ++num )
+    {
+        if (in_use[num])
+        {
+            snprintf(entry, sizeof(entry), "%010lu %05u n\r\n",
+                     static_cast<unsigned long>(offsets[num]), static_cast<unsigned>(generations[num]));
+        }
+        else
+        {
+            pdf_objnum next_free = num + 1;
+            while ( (next_free <= max_num) && in_use[next_free] )
+                ++next_free;
+            if (next_free > max_num)
+                next_free = 0;
+            snprintf(entry, sizeof(entry), "%010lu %05u f\r\n",
+                     static_cast<unsigned long>(next_free), (num == 0) ? 65535u : 1u);
+        }
+        layout.xref += entry;
+    }
+    layout.xref += "trailer\n";
+
+    // same keys PoDoFo's writer carries over into a fresh trailer
+    layout.trailer.Clear();
+    layout.trailer.AddKey("Size", PdfObject(static_cast<pdf_int64>(max_num + 1)));
+    const char *trailer_keys[] = { "Root", "Info", "ID" };
+    for ( const char *key : trailer_keys )
+    {
+        if (pdf.GetTrailer()->GetDictionary().HasKey(key))
+            layout.trailer.AddKey(key, *pdf.GetTrailer()->GetDictionary().GetKey(key));
+    }
+
+    PdfOutputDevice trailer_length;
+    layout.trailer.Write(&trailer_length, layout.mode);
+    layout.tail = "\nstartxref\n" + to_string(xref_offset) + "\n%%EOF\n";
+    layout.size = xref_offset + layout.xref.size() + trailer_length.GetLength() + layout.tail.size();
+}
+
+void SerializePlate( const PLATE_LAYOUT &layout, PdfOutputDevice &device )
+{
+    size_t start = device.Tell();
+    device.Write(layout.header.c_str(), layout.header.size());
+    if (layout.linear.empty())
+    {
+        for ( PdfObject *obj : layout.objects )
+            obj->WriteObject(&device, layout.mode, NULL);
+        for ( const string &packed : layout.packed )
+            device.Write(packed.c_str(), packed.size());
+        device.Write(layout.xref.c_str(), layout.xref.size());
+        if (!layout.xrefStream)
+            layout.trailer.Write(&device, layout.mode);
+        device.Write(layout.tail.c_str(), layout.tail.size());
+    }
+    for ( const LINEAR_PIECE &piece : layout.linear )
+    {
+        device.Write(piece.text.c_str(), piece.text.size());
+        if (!piece.stream)
+            continue;
+        const PdfStream *stream = piece.stream->GetStream();
+        device.Write(stream->GetInternalBuffer(), stream->GetInternalBufferSize());
+        device.Write(LINEAR_STREAM_END, strlen(LINEAR_STREAM_END));
+    }
+    PODOFO_RAISE_LOGIC_IF( device.Tell() - start != layout.size, "Pre-computed output size does not match written size" );
+}
+
+void WritePlate( PdfMemDocument &pdf, const string &path, const OUTPUT &output )
+// Writes the document in one sequential pass into a temporary file that is
+// mapped at its final size, then moves it into place
+{
+    if (pdf.GetEncrypted())
+    {
+        // keep PoDoFo's writer for encrypted documents, only the file is written atomically
+        PdfRefCountedBuffer buffer;
+        PdfOutputDevice device( &buffer );
+        pdf.Write( &device );
+        WriteFileAtomic( path, buffer.GetBuffer(), device.GetLength() );
+        return;
+    }
+
+    PLATE_LAYOUT layout;
+    LayoutPlate( pdf, layout, output );
+
+    string tmp_path = path + ".XXXXXX";
+    vector<char> tmp_name(tmp_path.begin(), tmp_path.end());
+    tmp_name.push_back('\0');
+    int fd = mkstemp(&tmp_name[0]);
+    if (fd < 0)
+        PODOFO_RAISE_ERROR_INFO( ePdfError_FileNotFound, path.c_str() );
+
+    void *map = MAP_FAILED;
+    bool created = (fchmod(fd, NEW_FILE_MODE) == 0);
+    if ( created && (ftruncate(fd, layout.size) == 0) )
+        map = mmap(NULL, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED)
+    {
+        // file systems without shared mappings, or no address space left for
+        // the mapping: the plate is streamed into the file, not buffered whole
+        bool written = false;
+        try
+        {
+            ofstream out( &tmp_name[0], ios::binary | ios::trunc );
+            PdfOutputDevice device( &out );
+            SerializePlate( layout, device );
+            out.flush();
+            written = created && out.good() && (fsync(fd) == 0);
+        }
+        catch ( ... )
+        {
+            close(fd);
+            unlink(&tmp_name[0]);
+            throw;
+        }
+        if ( (close(fd) != 0) || !written || (rename(&tmp_name[0], path.c_str()) != 0) )
+        {
+            unlink(&tmp_name[0]);
+            PODOFO_RAISE_ERROR_INFO( ePdfError_InvalidHandle, path.c_str() );
+        }
+        return;
+    }
+    close(fd);
+
+    try
+    {
+        PdfOutputDevice device( static_cast<char*>(map), layout.size );
+        SerializePlate( layout, device );
+    }
+    catch ( PdfError & )
+    {
+        munmap(map, layout.size);
+        unlink(&tmp_name[0]);
+        throw;
+    }
+
+    bool synced = (msync(map, layout.size, MS_SYNC) == 0);
+    munmap(map, layout.size);
+    if ( !synced || (rename(&tmp_name[0], path.c_str()) != 0) )
+    {
+        unlink(&tmp_name[0]);
+        PODOFO_RAISE_ERROR_INFO( ePdfError_InvalidHandle, path.c_str() );
+    }
+}
+
+void WriteTarHeader( ostream &out, const string &name, size_t size, char type )
+{
+    char block[512];
+    memset(block, 0, sizeof(block));
+    strncpy(block, name.c_str(), 99);
+    snprintf(block + 100, 8, "%07o", 0644);
+    snprintf(block + 108, 8, "%07o", 0);
+    snprintf(block + 116, 8, "%07o", 0);
+    snprintf(block + 124, 12, "%011lo", static_cast<unsigned long>(size));
+    snprintf(block + 136, 12, "%011lo", static_cast<unsigned long>(time(NULL)));
+    memset(block + 148, ' ', 8);
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    unsigned int sum = 0;
+    for ( unsigned char c : block )
+        sum += c;
+    snprintf(block + 148, 8, "%06o", sum);
+    out.write(block, sizeof(block));
+}
+
+void WriteTarPadding( ostream &out, size_t size )
+{
+    static const char zeros[512] = { 0 };
+    if (size % 512)
+        out.write(zeros, 512 - size % 512);
+}
+
+void WriteTarEntry( ostream &out, const string &name, PdfMemDocument &pdf, const OUTPUT &output )
+// Appends the plate to a tar stream, the pre-computed layout gives the entry
+// size so the plate is serialised straight into the stream
+{
+    if (name.size() > 99)
+    {
+        // pax header carrying the full name
+        string record = " path=" + name + "\n";
+        size_t len = record.size();
+        len += to_string(len + to_string(len).size()).size();
+        record = to_string(len) + record;
+        WriteTarHeader( out, "PaxHeader", record.size(), 'x' );
+        out.write(record.c_str(), record.size());
+        WriteTarPadding( out, record.size() );
+    }
+
+    if (pdf.GetEncrypted())
+    {
+        PdfRefCountedBuffer buffer;
+        PdfOutputDevice device( &buffer );
+        pdf.Write( &device );
+        WriteTarHeader( out, name, device.GetLength(), '0' );
+        out.write(buffer.GetBuffer(), device.GetLength());
+        WriteTarPadding( out, device.GetLength() );
+        return;
+    }
+
+    PLATE_LAYOUT layout;
+    LayoutPlate( pdf, layout, output );
+    WriteTarHeader( out, name, layout.size, '0' );
+    PdfOutputDevice device( &out );
+    SerializePlate( layout, device );
+    device.Flush();
+    WriteTarPadding( out, layout.size );
+}
+
+void FinishTar( ostream &out )
+{
+    static const char zeros[1024] = { 0 };
+    out.write(zeros, sizeof(zeros));
+    out.flush();
+}
+
+string PlateFileName( const string &input, const string &plate, const OUTPUT &output )
+// Expands the naming template: {input} is the input file name without its
+// extension, {plate} the spot name or "remaining". Unescaped spot names
+// may hold '/', NUL or control characters, those become '_'.
+{
+    string safe = plate;
+    for ( char &c : safe )
+    {
+        unsigned char u = static_cast<unsigned char>(c);
+        if ( (u < 0x20) || (u == 0x7F) || (c == '/') )
+            c = '_';
+    }
+
+    size_t slash = input.rfind('/');
+    string dir = (slash == string::npos) ? "" : input.substr(0, slash + 1);
+    string base = (slash == string::npos) ? input : input.substr(slash + 1);
+    if (iends_with(base, ".pdf"))
+        base.erase(base.size() - 4);
+
+    // one pass over the template, braces in the names are not expanded again
+    const string &templ = output.nameTemplate;
+    string name;
+    for ( size_t pos = 0; pos < templ.size(); )
+    {
+        if (templ.compare(pos, 7, "{input}") == 0)
+        {
+            name += base;
+            pos += 7;
+        }
+        else if (templ.compare(pos, 7, "{plate}") == 0)
+        {
+            name += safe;
+            pos += 7;
+        }
+        else
+            name += templ[pos++];
+    }
+
+    if (output.toArchive)
+        return name;
+    if (!output.dir.empty())
+        dir = (output.dir[output.dir.size() - 1] == '/') ? output.dir : output.dir + "/";
+    return dir + name;
+}
+
+void EmitFile( const string &name, const char *data, size_t size, const OUTPUT &output )
+{
+    if (output.toArchive)
+    {
+        WriteTarHeader( cout, name, size, '0' );
+        cout.write(data, size);
+        WriteTarPadding( cout, size );
+    }
+    else
+        WriteFileAtomic( name, data, size );
+    Progress( output, "file", "\"file\": " + JsonString(name) );
+}
+
+void EmitPlateBytes( const char *data, size_t size, const string &filename, const string &plate, const OUTPUT &output )
+// Emits an already serialised plate, e.g. one taken from the cache
+{
+    EmitFile( PlateFileName(filename, plate, output), data, size, output );
+}
+
+void EmitPlate( PdfMemDocument &pdf, const string &filename, const string &plate, const OUTPUT &output,
+                const CACHE &cache, const string &plateKey )
+{
+    if (!cache.dir.empty())
+    {
+        // serialise once, the same bytes go to the output and the cache
+        PdfRefCountedBuffer buffer;
+        PdfOutputDevice device( &buffer );
+        if (pdf.GetEncrypted())
+            pdf.Write( &device );
+        else
+        {
+            PLATE_LAYOUT layout;
+            LayoutPlate( pdf, layout, output );
+            SerializePlate( layout, device );
+        }
+        EmitPlateBytes( buffer.GetBuffer(), device.GetLength(), filename, plate, output );
+        CacheStore( cache, PlateFileKey(plateKey, output), ".pdf", buffer.GetBuffer(), device.GetLength() );
+        return;
+    }
+
+    string name = PlateFileName( filename, plate, output );
+    if (output.toArchive)
+        WriteTarEntry( cout, name, pdf, output );
+    else
+        WritePlate( pdf, name, output );
+    Progress( output, "file", "\"file\": " + JsonString(name) );
+}
+
+const char *PROCESS_NAMES[4] = { "Cyan", "Magenta", "Yellow", "Black" };
+
+struct TINT_HISTOGRAM {
+    unsigned long counts[11];       // paths painted per tint: 0%, then steps of 10%
+    unsigned long dropped;          // zero tint paths left out
+
+    TINT_HISTOGRAM() : counts(), dropped(0) {}
+
+    void Add( const TINT_HISTOGRAM &other )
+    {
+        for ( size_t b = 0; b < 11; ++b )
+            counts[b] += other.counts[b];
+        dropped += other.dropped;
+    }
+};
+
+struct COVERAGE {
+    int page;                       // in the input, 1-based
+    double area;                    // percent of the page with ink of the plate
+    double tint;                    // percent of full ink over the page
+};
+
+struct PLATE {
+    PLATE_KIND kind;
+    struct SPOT spot;               // PLATE_SPOT only
+    int channel;                    // PLATE_PROCESS only: 0..3 for C, M, Y, K
+    string name;                    // spot name, process color or "remaining"
+    string key;                     // cache key
+    string cached;                  // complete plate from the cache, nothing to build
+    vector<string> pages;           // compressed content per page
+    vector<set<string>> names;      // resource names the content of each page uses
+    TINT_HISTOGRAM tints;           // of the pages separated in this run
+    vector<COVERAGE> coverage;      // per page, with --coverage
+};
+
+struct CONTENT_SOURCE {
+    const char *data;               // stream data owned by the document, NULL if decoded
+    size_t size;
+    bool deflated;                  // plain FlateDecode, inflated while it is read
+    string decoded;                 // streams with other filters are decoded up front
+};
+
+struct SHADING_ROUTE {
+    vector<uint64_t> keep;          // mask of the plates drawing the shading
+    vector<string> names;           // per plate: resource name of its own copy, empty for the original
+};
+
+// routes of a page's shadings or shading patterns, by escaped resource name
+typedef unordered_map<string, SHADING_ROUTE> SHADING_TABLE;
+
+// device family of a page's ICC or CIE based color spaces, by escaped resource name
+typedef unordered_map<string, string> SPACE_TABLE;
+
+struct EXTRA_RESOURCE {
+    string category;                // resource dictionary the copy is listed in
+    PdfReference ref;
+};
+
+// PRESCAN_VERBATIM: no selected spot can be painted on the page,
+// PRESCAN_SEARCH: only if its content names one
+enum PRESCAN_MODE { PRESCAN_NONE, PRESCAN_VERBATIM, PRESCAN_SEARCH };
+
+struct PAGE_JOB {
+    int pageNum;
+    vector<CONTENT_SOURCE> sources; // content streams of the page, read stage only
+    SHADING_TABLE shadings;         // for the rewrite stage
+    SHADING_TABLE patterns;
+    SPACE_TABLE spaces;
+    vector<string> plates;          // content per pending plate: one part of the page until the
+                                    // compress stage, the whole deflated page after it
+    vector<set<string>> names;      // resource names per plate, found by the compress stage
+    vector<TINT_HISTOGRAM> tints;   // per plate, with the last part of the page
+    PRESCAN_MODE prescan;           // for the rewrite stage
+    bool last;                      // last part of the page
+    bool cached;                    // plate contents came from the page cache
+    size_t footprint;               // bytes held from the memory budget while the page is rewritten
+    exception_ptr error;
+
+    explicit PAGE_JOB( int page ) : pageNum(page), prescan(PRESCAN_NONE), last(true), cached(false), footprint(0) {}
+    ~PAGE_JOB() { memoryBudget.Release( footprint ); }
+};
+
+typedef unique_ptr<PAGE_JOB> PAGE_JOB_PTR;
+
+template <class T>
+class BoundedQueue
+// Hands work from one pipeline stage to the next, Push() blocks while the
+// queue is full so a fast stage can not run away from a slow one
+{
+public:
+    explicit BoundedQueue( size_t capacity ) : m_capacity(capacity), m_closed(false) {}
+
+    void Push( T item )
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_notFull.wait(lock, [this] { return m_items.size() < m_capacity; });
+        m_items.push_back(move(item));
+        m_notEmpty.notify_one();
+    }
+
+    // false once the queue is closed and drained
+    bool Pop( T &item )
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_notEmpty.wait(lock, [this] { return !m_items.empty() || m_closed; });
+        if (m_items.empty())
+            return false;
+        item = move(m_items.front());
+        m_items.pop_front();
+        m_notFull.notify_one();
+        return true;
+    }
+
+    void Close()
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_closed = true;
+        m_notEmpty.notify_all();
+    }
+
+private:
+    size_t m_capacity;
+    bool m_closed;
+    deque<T> m_items;
+    mutex m_mutex;
+    condition_variable m_notEmpty;
+    condition_variable m_notFull;
+};
+
+class PlateRouter
+// Maps color space names to small integer ids once, each id carries the
+// mask of plates that keep what is painted in it. A mask has one bit per
+// plate, so routing an operator is a bit test instead of string compares.
+{
+public:
+    typedef vector<uint64_t> MASK;
+
+    PlateRouter( const vector<PLATE*> &plates, const vector<SPOT> &selection )
+        : m_plates(plates), m_words((plates.size() + 63) / 64)
+    {
+        for ( const SPOT &el : selection )
+            m_selected.insert(el.csId);
+        m_cmyk = m_initial = MASK(m_words, 0);
+        for ( size_t p = 0; p < plates.size(); ++p )
+        {
+            if (plates[p]->kind == PLATE_PROCESS)
+            {
+                Set(m_cmyk, p);
+                if (plates[p]->channel == 3)
+                    Set(m_initial, p);
+            }
+            else if (plates[p]->kind == PLATE_REMAINING)
+            {
+                Set(m_cmyk, p);
+                Set(m_initial, p);
+            }
+        }
+    }
+
+    static bool Test( const MASK &mask, size_t p ) { return (mask[p >> 6] >> (p & 63)) & 1; }
+    static void Set( MASK &mask, size_t p ) { mask[p >> 6] |= uint64_t(1) << (p & 63); }
+
+    // default color is DeviceGray black, never a selected spot
+    const MASK &Initial() const { return m_initial; }
+    // k/K: remaining and process plates
+    const MASK &Cmyk() const { return m_cmyk; }
+
+    // Tint of the current color on each plate, negative where it is not known.
+    // Only spot plates in their own color space and process plates in CMYK
+    // or gray, ICC based ones included, or in a Separation of their colorant
+    // have one; cs sets the initial color of the space. family is that of a
+    // named space, see DeviceFamily.
+    vector<float> InitialTints() const
+    {
+        vector<float> tints( m_plates.size(), -1 );
+        for ( size_t p = 0; p < m_plates.size(); ++p )
+        {
+            if (m_plates[p]->kind == PLATE_PROCESS)
+                tints[p] = (m_plates[p]->channel == 3) ? 1 : 0;
+        }
+        return tints;
+    }
+
+    void Tints( bool initial, bool cmyk, bool gray, const string &csName, const string &family,
+                const vector<PdfVariant> &args, vector<float> &tints ) const
+    {
+        for ( size_t p = 0; p < m_plates.size(); ++p )
+        {
+            const PLATE &plate = *m_plates[p];
+            float &tint = tints[p];
+            tint = -1;
+            if ( (plate.kind == PLATE_SPOT) && (csName == plate.spot.csId) )
+            {
+                if (initial)
+                    tint = 1;
+                else if (args.size() == 1)
+                    TintValue(args[0], tint);
+            }
+            else if ( (plate.kind == PLATE_PROCESS) && cmyk )
+            {
+                if (initial)
+                    tint = (plate.channel == 3) ? 1 : 0;
+                else if (args.size() == 4)
+                    TintValue(args[plate.channel], tint);
+            }
+            else if ( (plate.kind == PLATE_PROCESS) && (family == PROCESS_NAMES[plate.channel]) )
+            {
+                if (initial)
+                    tint = 1;
+                else if (args.size() == 1)
+                    TintValue(args[0], tint);
+            }
+            else if ( (plate.kind == PLATE_PROCESS) && gray )
+            {
+                // only black carries gray, as 1 - gray
+                if (plate.channel != 3)
+                    tint = 0;
+                else if (initial)
+                    tint = 1;
+                else if ( (args.size() == 1) && TintValue(args[0], tint) )
+                    tint = 1 - tint;
+            }
+        }
+    }
+
+    // plates keeping paint in the named color space, computed on first use;
+    // family is the device space it is based on, see DeviceFamily
+    const MASK &ColorSpace( const string &name, const string &family )
+    {
+        string id = family.empty() ? name : name + "\n" + family;
+        unordered_map<string, int>::const_iterator it = m_ids.find(id);
+        if (it != m_ids.end())
+            return m_masks[it->second];
+
+        MASK mask(m_words, 0);
+        for ( size_t p = 0; p < m_plates.size(); ++p )
+        {
+            const PLATE &plate = *m_plates[p];
+            bool keep = false;
+            if (plate.kind == PLATE_SPOT)
+                keep = (name == plate.spot.csId);
+            else if (plate.kind == PLATE_REMAINING)
+                keep = (m_selected.count(name) == 0);
+            else
+                keep = (family == "DeviceCMYK") || ((family == "DeviceGray") && (plate.channel == 3))
+                       || (family == PROCESS_NAMES[plate.channel]);
+            if (keep)
+                Set(mask, p);
+        }
+        m_ids[id] = m_masks.size();
+        m_masks.push_back(mask);
+        return m_masks.back();
+    }
+
+private:
+    const vector<PLATE*> &m_plates;
+    size_t m_words;
+    unordered_set<string> m_selected;
+    unordered_map<string, int> m_ids;
+    deque<MASK> m_masks;
+    MASK m_cmyk, m_initial;
+
+    static bool TintValue( const PdfVariant &value, float &tint )
+    {
+        if ( !value.IsNumber() && !value.IsReal() )
+            return false;
+        tint = static_cast<float>( value.GetReal() );
+        return true;
+    }
+};
+
+void AddContentSource( const PdfObject *stream, vector<CONTENT_SOURCE> &sources )
+// FlateDecode without a predictor, the filter of almost every content stream,
+// is inflated by the rewriter while it reads. Anything else is decoded here.
+{
+    const PdfDictionary &dict = stream->GetDictionary();
+    const PdfObject *filter = dict.GetKey( PdfName::KeyFilter );
+    if ( filter && filter->IsArray() && (filter->GetArray().GetSize() == 1) )
+        filter = &filter->GetArray()[0];
+    const PdfObject *parms = dict.GetKey( "DecodeParms" );
+    bool no_parms = (parms == NULL) || parms->IsNull()
+                    || (parms->IsDictionary() && (parms->GetDictionary().GetKeyAsLong("Predictor", 1) <= 1));
+    bool flate = filter && filter->IsName() && (filter->GetName() == PdfName("FlateDecode"));
+
+    CONTENT_SOURCE source;
+    const PdfStream *data = stream->GetStream();
+    if ( no_parms && ((filter == NULL) || flate) )
+    {
+        source.data = data->GetInternalBuffer();
+        source.size = data->GetInternalBufferSize();
+        source.deflated = flate;
+    }
+    else
+    {
+        PdfRefCountedBuffer buffer;
+        PdfOutputDevice device( &buffer );
+        data->GetFilteredCopy(&device);
+        if (device.GetLength())
+            source.decoded.assign( buffer.GetBuffer(), device.GetLength() );
+        source.data = NULL;
+        source.size = source.decoded.size();
+        source.deflated = false;
+    }
+    sources.push_back(move(source));
+}
+
+void PageSources( PdfPage *pPage, vector<CONTENT_SOURCE> &sources )
+// The content streams of the page, in the order of its /Contents array
+{
+    PdfObject *contents = pPage->GetContents();
+    if (contents == NULL)
+        return;
+
+    if (contents->IsArray())
+    {
+        const PdfArray &streams = contents->GetArray();
+        for ( size_t i = 0; i < streams.GetSize(); ++i )
+        {
+            const PdfObject *stream = &streams[i];
+            if (stream->IsReference())
+                stream = contents->GetOwner()->GetObject(stream->GetReference());
+            if (stream && stream->HasStream())
+                AddContentSource( stream, sources );
+        }
+    }
+    else if (contents->HasStream())
+        AddContentSource( contents, sources );
+}
+
+class ContentReader
+// Hands out the decoded contents of a page in chunks. Deflated streams are
+// inflated one chunk at a time, so a huge page is never decoded as a whole.
+{
+public:
+    static const size_t CHUNK = 1 << 20;
+
+    explicit ContentReader( const vector<CONTENT_SOURCE> &sources )
+        : m_sources(sources), m_next(0), m_offset(0), m_inflating(false) {}
+
+    ~ContentReader()
+    {
+        if (m_inflating)
+            inflateEnd(&m_stream);
+    }
+
+    // appends the next chunk, false once every stream is read
+    bool Read( string &chunk )
+    {
+        if (!m_putBack.empty())
+        {
+            chunk += m_putBack;
+            m_putBack.clear();
+            return true;
+        }
+        while ( m_next < m_sources.size() )
+        {
+            const CONTENT_SOURCE &source = m_sources[m_next];
+            size_t before = chunk.size();
+            if ( source.deflated ? Inflate(source, chunk) : Copy(source, chunk) )
+            {
+                // the streams of a /Contents array are separated by a line break
+                chunk += '\n';
+                m_offset = 0;
+                ++m_next;
+            }
+            if (chunk.size() > before)
+                return true;
+        }
+        return false;
+    }
+
+    // content already read, handed out again by the next Read
+    void PutBack( string &data ) { m_putBack.swap(data); }
+
+private:
+    // true at the end of the stream
+    bool Copy( const CONTENT_SOURCE &source, string &chunk )
+    {
+        const char *data = source.data ? source.data : source.decoded.data();
+        size_t n = min(CHUNK, source.size - m_offset);
+        chunk.append(data + m_offset, n);
+        m_offset += n;
+        return m_offset == source.size;
+    }
+
+    bool Inflate( const CONTENT_SOURCE &source, string &chunk )
+    {
+        if (!m_inflating)
+        {
+            memset(&m_stream, 0, sizeof(m_stream));
+            if (inflateInit(&m_stream) != Z_OK)
+                PODOFO_RAISE_ERROR( ePdfError_Flate );
+            m_inflating = true;
+        }
+
+        size_t start = chunk.size();
+        chunk.resize(start + CHUNK);
+        m_stream.next_out = reinterpret_cast<Bytef*>(&chunk[start]);
+        m_stream.avail_out = CHUNK;
+        bool end = false;
+        while ( m_stream.avail_out && !end )
+        {
+            if ( (m_stream.avail_in == 0) && (m_offset < source.size) )
+            {
+                size_t n = min(source.size - m_offset, size_t(1) << 30);
+                m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(source.data + m_offset));
+                m_stream.avail_in = n;
+                m_offset += n;
+            }
+            int ret = inflate(&m_stream, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END)
+                end = true;
+            // no progress without more input: a truncated stream ends here
+            else if ( (ret == Z_BUF_ERROR) && (m_stream.avail_in == 0) && (m_offset == source.size) )
+                end = true;
+            else if (ret != Z_OK)
+                PODOFO_RAISE_ERROR( ePdfError_Flate );
+        }
+        chunk.resize(start + CHUNK - m_stream.avail_out);
+        if (end)
+        {
+            inflateEnd(&m_stream);
+            m_inflating = false;
+        }
+        return end;
+    }
+
+    const vector<CONTENT_SOURCE> &m_sources;
+    size_t m_next;                  // current stream
+    size_t m_offset;                // read position in the current stream
+    bool m_inflating;
+    z_stream m_stream;
+    string m_putBack;
+};
+
+class ContentSegmenter
+// Cuts decoded content into segments the tokenizer can read on their own:
+// a segment ends right after an operator, never inside a string, array,
+// dictionary or inline image. An inline image, BI to EI, is a segment of
+// its own, so its data can be passed on as it is. What is held stays near
+// SEGMENT_LIMIT: a longer run of operands is cut after one of them, the
+// kernel keeps them until their operator, and a larger inline image goes on
+// in parts.
+{
+public:
+    static const size_t SEGMENT_LIMIT = ContentReader::CHUNK;
+
+    ContentSegmenter()
+        : m_scan(0), m_cut(0), m_operand(0), m_token(string::npos), m_mode(MODE_NORMAL),
+          m_depth(0), m_nesting(0), m_escape(false), m_image(false),
+          m_imageBegin(string::npos), m_imageData(0), m_imageEnd(string::npos), m_header(0),
+          m_open(false), m_continued(false) {}
+
+    void Append( const string &chunk ) { m_buffer += chunk; }
+
+    // the next complete segment, at the end of the content whatever is left
+    bool Next( string &segment, bool final )
+    {
+        size_t size = m_buffer.size();
+        while ( (m_scan < size) && (m_imageEnd == string::npos) && Step(size, final) ) {}
+
+        // the operators before an inline image go first, then the image
+        size_t cut = final ? size : m_cut;
+        bool part = false;
+        m_header = 0;
+        if ( (m_imageBegin != string::npos) && (m_imageBegin > 0) )
+            cut = m_imageBegin;
+        else if (m_imageEnd != string::npos)
+        {
+            cut = m_imageEnd;
+            m_header = m_imageData;
+        }
+        else if ( !final && (m_mode == MODE_IMAGE) && (m_imageBegin == 0) && (m_scan >= SEGMENT_LIMIT) )
+        {
+            // the data scanned so far holds no EI
+            cut = m_scan;
+            m_header = m_imageData;
+            part = true;
+        }
+        else if ( !final && !m_image && (m_operand >= SEGMENT_LIMIT) && (m_operand > cut) )
+            cut = m_operand;
+        // an image still open at the end gets its last, empty part
+        if ( (cut == 0) && !(final && m_open) )
+            return false;
+        m_continued = m_open;
+        m_open = part;
+        segment.assign(m_buffer, 0, cut);
+        m_buffer.erase(0, cut);
+        m_scan -= min(m_scan, cut);
+        if (m_token != string::npos)
+            m_token = (m_token >= cut) ? m_token - cut : string::npos;
+        m_cut -= min(m_cut, cut);
+        m_operand -= min(m_operand, cut);
+        if (part)
+            m_imageBegin = m_imageData = 0;
+        else if ( m_header || m_continued || ((m_imageBegin != string::npos) && (m_imageBegin < cut)) )
+            m_imageBegin = m_imageEnd = string::npos;
+        else if (m_imageBegin != string::npos)
+        {
+            m_imageBegin -= cut;
+            m_imageData -= min(m_imageData, cut);
+            if (m_imageEnd != string::npos)
+                m_imageEnd -= cut;
+        }
+        return true;
+    }
+
+    // for the segment Next returned last: the size of its BI ... ID part if
+    // it is an inline image, 0 otherwise
+    size_t InlineImageHeader() const { return m_header; }
+    // whether it is inline image data going on from the segment before,
+    // and whether the image goes on in the next
+    bool InlineImageContinued() const { return m_continued; }
+    bool InlineImageOpen() const { return m_open; }
+
+private:
+    enum MODE { MODE_NORMAL, MODE_STRING, MODE_HEX, MODE_COMMENT, MODE_IMAGE };
+
+    // scans one byte or token delimiter, false if more data is needed first
+    bool Step( size_t size, bool final )
+    {
+        const char *p = m_buffer.data();
+        size_t i = m_scan;
+        unsigned char c = p[i];
+        switch (m_mode)
+        {
+        case MODE_STRING:
+            if (m_escape)
+                m_escape = false;
+            else if (c == '\\')
+                m_escape = true;
+            else if (c == '(')
+                ++m_depth;
+            else if ( (c == ')') && (--m_depth == 0) )
+            {
+                m_mode = MODE_NORMAL;
+                EndOperand(i + 1);
+            }
+            m_scan = i + 1;
+            return true;
+        case MODE_HEX:
+            if (c == '>')
+            {
+                m_mode = MODE_NORMAL;
+                EndOperand(i + 1);
+            }
+            m_scan = i + 1;
+            return true;
+        case MODE_COMMENT:
+            if ( (c == '\r') || (c == '\n') )
+                m_mode = MODE_NORMAL;
+            m_scan = i + 1;
+            return true;
+        case MODE_IMAGE:
+            // the data ends at "EI" followed by whitespace, the way the tokenizer reads it
+            if (c != 'E')
+            {
+                m_scan = i + 1;
+                return true;
+            }
+            if ( (i + 2 >= size) && !final )
+                return false;
+            if ( (i + 1 < size) && (p[i + 1] == 'I') )
+            {
+                if ( (i + 2 >= size) || PdfTokenizer::IsWhitespace(p[i + 2]) )
+                {
+                    m_mode = MODE_NORMAL;
+                    m_token = i;
+                }
+                m_scan = i + 2;
+            }
+            else
+                m_scan = i + 1;
+            return true;
+        case MODE_NORMAL:
+            break;
+        }
+
+        if (PdfTokenizer::IsRegular(c))
+        {
+            if (m_token == string::npos)
+                m_token = i;
+            m_scan = i + 1;
+            return true;
+        }
+        // whitespace or a delimiter ends a token
+        if (m_token != string::npos)
+        {
+            EndToken(i);
+            if (m_mode == MODE_IMAGE)
+            {
+                // the single whitespace after ID
+                m_scan = i + 1;
+                m_imageData = m_scan;
+                return true;
+            }
+        }
+
+        switch (c)
+        {
+        case '/':
+            m_token = i;
+            break;
+        case '%':
+            m_mode = MODE_COMMENT;
+            break;
+        case '(':
+            m_mode = MODE_STRING;
+            m_depth = 1;
+            break;
+        case '<':
+        case '>':
+            if ( (i + 1 >= size) && !final )
+                return false;
+            if ( (i + 1 < size) && (p[i + 1] == c) )
+            {
+                if (c == '<')
+                    ++m_nesting;
+                else if (m_nesting)
+                {
+                    --m_nesting;
+                    EndOperand(i + 2);
+                }
+                ++i;
+            }
+            else if (c == '<')
+                m_mode = MODE_HEX;
+            break;
+        case '[':
+            ++m_nesting;
+            break;
+        case ']':
+            if (m_nesting)
+            {
+                --m_nesting;
+                EndOperand(i + 1);
+            }
+            break;
+        }
+        m_scan = i + 1;
+        return true;
+    }
+
+    void EndToken( size_t end )
+    {
+        const char *t = m_buffer.data() + m_token;
+        size_t len = end - m_token;
+        m_token = string::npos;
+
+        // names, numbers and the other operands
+        if ( (t[0] == '/') || strchr("+-.0123456789", t[0]) )
+        {
+            EndOperand(end);
+            return;
+        }
+        string keyword(t, len);
+        if ( (keyword == "true") || (keyword == "false") || (keyword == "null") )
+        {
+            EndOperand(end);
+            return;
+        }
+
+        if (keyword == "BI")
+        {
+            m_image = true;
+            m_imageBegin = m_cut;
+            m_imageData = 0;
+        }
+        else if (keyword == "ID")
+        {
+            m_mode = MODE_IMAGE;
+            return;
+        }
+        else if ( (keyword == "EI") && m_image )
+        {
+            m_image = false;
+            if (m_imageBegin != string::npos)
+                m_imageEnd = end;
+        }
+        if ( !m_image && (m_nesting == 0) )
+            m_cut = m_operand = end;
+    }
+
+    // an operand outside of arrays, dictionaries and inline images, the
+    // segment may end after it
+    void EndOperand( size_t end )
+    {
+        if ( !m_image && (m_nesting == 0) )
+            m_operand = end;
+    }
+
+    string m_buffer;
+    size_t m_scan;                  // next byte to look at
+    size_t m_cut;                   // end of the last operator, 0 if none yet
+    size_t m_operand;               // end of the last operand or operator
+    size_t m_token;                 // start of the token being read
+    MODE m_mode;
+    int m_depth;                    // parentheses in a string
+    int m_nesting;                  // open arrays and dictionaries
+    bool m_escape;
+    bool m_image;                   // between BI and EI
+    size_t m_imageBegin;            // where the segment of an inline image starts
+    size_t m_imageData;             // and its data
+    size_t m_imageEnd;              // after its EI, once it is complete
+    size_t m_header;                // of the segment returned last
+    bool m_open;                    // it is inline image data without its EI
+    bool m_continued;               // it goes on from the segment before
+};
+
+void WriteProcessTint( const vector<PdfVariant> &rArgs, int channel, const char* pszKeyword, PdfOutputDevice &rDevice )
+// Keeps the plate's own channel of a CMYK color and zeroes the others
+{
+    for ( size_t i = 0; i < rArgs.size(); ++i )
+    {
+        if (static_cast<int>(i) == channel)
+            rArgs[i].Write(&rDevice, ePdfWriteMode_Compact);
+        else
+            PdfVariant(static_cast<pdf_int64>(0)).Write(&rDevice, ePdfWriteMode_Compact);
+    }
+    vector<PdfVariant> none;
+    WriteOperator(none, pszKeyword, rDevice);
+}
+
+enum CONTENT_OP { OP_OTHER, OP_SAVE, OP_RESTORE, OP_COLOR_SPACE, OP_COLOR, OP_CMYK, OP_GRAY, OP_RGB,
+                  OP_TEXT_BEGIN, OP_TEXT_END, OP_TEXT_SHOW, OP_TEXT_POSITION, OP_TEXT_RENDER,
+                  OP_XOBJECT, OP_PATH_BEGIN, OP_PATH_END, OP_SHADING };
+
+CONTENT_OP ClassifyOperator( const char *kw )
+// Only the operators the rewriter cares about, everything else is OP_OTHER
+{
+    size_t len = strlen(kw);
+    if ( (len == 0) || (len > 3) )
+        return OP_OTHER;
+    char c = kw[0], c1 = kw[1];
+    switch (c)
+    {
+    case 'c': case 'C':
+        return (len == 2 && (c1 == 's' || c1 == 'S')) ? OP_COLOR_SPACE : OP_OTHER;
+    case 's': case 'S':
+        if (len == 1)
+            return OP_PATH_END;
+        if ( (len == 2 && (c1 == 'c' || c1 == 'C')) || (len == 3 && (c1 == 'c' || c1 == 'C') && (kw[2] == 'n' || kw[2] == 'N')) )
+            return OP_COLOR;
+        return (len == 2 && c == 's' && c1 == 'h') ? OP_SHADING : OP_OTHER;
+    case 'k': case 'K':
+        return (len == 1) ? OP_CMYK : OP_OTHER;
+    case 'g': case 'G':
+        return (len == 1) ? OP_GRAY : OP_OTHER;
+    case 'B':
+        if (len == 1 || (len == 2 && c1 == '*'))
+            return OP_PATH_END;
+        return (len == 2 && c1 == 'T') ? OP_TEXT_BEGIN : OP_OTHER;
+    case 'E':
+        return (len == 2 && c1 == 'T') ? OP_TEXT_END : OP_OTHER;
+    case 'D':
+        return (len == 2 && c1 == 'o') ? OP_XOBJECT : OP_OTHER;
+    case 'T':
+        if (len != 2)
+            return OP_OTHER;
+        if (c1 == 'j' || c1 == 'J')
+            return OP_TEXT_SHOW;
+        if (c1 == 'd' || c1 == 'D' || c1 == 'm' || c1 == '*')
+            return OP_TEXT_POSITION;
+        return (c1 == 'r') ? OP_TEXT_RENDER : OP_OTHER;
+    case '\'': case '"':
+        return (len == 1) ? OP_TEXT_SHOW : OP_OTHER;
+    case 'm':
+        return (len == 1) ? OP_PATH_BEGIN : OP_OTHER;
+    case 'r':
+        if (len == 2 && c1 == 'e')
+            return OP_PATH_BEGIN;
+        return (len == 2 && c1 == 'g') ? OP_RGB : OP_OTHER;
+    case 'R':
+        return (len == 2 && c1 == 'G') ? OP_RGB : OP_OTHER;
+    case 'f': case 'F': case 'b':
+        if (len == 1 || (len == 2 && c1 == '*' && c != 'F'))
+            return OP_PATH_END;
+        return OP_OTHER;
+    case 'n':
+        return (len == 1) ? OP_PATH_END : OP_OTHER;
+    case 'q':
+        return (len == 1) ? OP_SAVE : OP_OTHER;
+    case 'Q':
+        return (len == 1) ? OP_RESTORE : OP_OTHER;
+    }
+    return OP_OTHER;
+}
+
+// Compile time behaviour of each kind of plate
+struct SpotPlateTraits {
+    static const bool keepsImages = false;
+    static const bool tintsCmyk = false;
+};
+
+struct ProcessPlateTraits {
+    static const bool keepsImages = false;
+    static const bool tintsCmyk = true;
+};
+
+struct RemainingPlateTraits {
+    static const bool keepsImages = true;
+    static const bool tintsCmyk = false;
+};
+
+template <class Traits>
+class PlateGroup
+// The outputs of all plates of one kind
+{
+public:
+    void Add( size_t plateIndex, int channel )
+    {
+        m_index.push_back(plateIndex);
+        m_channel.push_back(channel);
+    }
+
+    // a page starts with no ink on any plate and no text state held back
+    void BeginPage()
+    {
+        m_inked.assign(m_index.size(), false);
+        m_tints.assign(m_index.size(), TINT_HISTOGRAM());
+        m_held.clear();
+        m_held.resize(m_index.size());
+        m_pending.clear();
+        m_pending.resize(m_index.size());
+        for ( vector<PENDING_STATE> &levels : m_pending )
+            levels.resize(1);
+    }
+
+    void EndPage( vector<TINT_HISTOGRAM> &tints )
+    {
+        for ( size_t i = 0; i < m_index.size(); ++i )
+            tints[m_index[i]] = m_tints[i];
+        m_pending.clear();
+    }
+
+    // a text object or path in progress is not part of a segment's output, so
+    // Begin leaves it alone
+    void Begin()
+    {
+        m_buffers.assign(m_index.size(), PdfRefCountedBuffer());
+        m_devices.clear();
+        for ( size_t i = 0; i < m_index.size(); ++i )
+            m_devices.emplace_back( new PdfOutputDevice(&m_buffers[i]) );
+    }
+
+    void Color( const vector<PdfVariant> &args, const char *keyword, bool cmykValues )
+    {
+        for ( size_t i = 0; i < m_index.size(); ++i )
+        {
+            // cmyk colors become single channel tints on the process plates
+            if ( Traits::tintsCmyk && cmykValues && (args.size() == 4) )
+            {
+                WriteProcessTint(args, m_channel[i], keyword, Out(i));
+                if (m_inText)
+                    WriteProcessTint(args, m_channel[i], keyword, *m_text[i].stateDevice);
+            }
+            else
+                Write(i, args, keyword, true);
+        }
+    }
+
+    void Image( const vector<PdfVariant> &args, const char *keyword )
+    {
+        if (!Traits::keepsImages)
+            return;
+        for ( size_t i = 0; i < m_index.size(); ++i )
+        {
+            WriteOperator(args, keyword, Out(i));
+            m_inked[i] = true;
+        }
+    }
+
+    // the raw bytes of an inline image, for the plates keeping images or,
+    // for a stencil mask, those keeping its fill color. A large one comes in
+    // parts, last is false for all but the part ending with its EI.
+    void InlineImage( const char *data, size_t size, const PlateRouter::MASK *keep, bool last )
+    {
+        for ( size_t i = 0; i < m_index.size(); ++i )
+        {
+            if ( keep ? !PlateRouter::Test(*keep, m_index[i]) : !Traits::keepsImages )
+                continue;
+            PdfOutputDevice &out = Out(i);
+            out.Write(data, size);
+            if (last)
+                out.Write("\n", 1);
+            m_inked[i] = true;
+        }
+    }
+
+    // BT opens a text object on every plate, it is kept at ET only by the
+    // plates that show some of its text
+    void BeginText( const vector<PdfVariant> &args, const char *keyword )
+    {
+        m_text.clear();
+        m_text.resize(m_index.size());
+        for ( size_t i = 0; i < m_index.size(); ++i )
+        {
+            TEXT_OBJECT &text = m_text[i];
+            text.textDevice.reset( new PdfOutputDevice(&text.text) );
+            text.stateDevice.reset( new PdfOutputDevice(&text.state) );
+            text.textStateDevice.reset( new PdfOutputDevice(&text.textState) );
+        }
+        m_inText = true;
+        for ( size_t i = 0; i < m_index.size(); ++i )
+            WriteOperator(args, keyword, Out(i));
+    }
+
+    // Text state and positioning, persists is false for the operators whose
+    // effect ends with the text object
+    void TextState( const vector<PdfVariant> &args, const char *keyword, bool persists )
+    {
+        for ( size_t i = 0; i < m_index.size(); ++i )
+            Write(i, args, keyword, persists);
+    }
+
+    // Tj, TJ, ' and ": plates outside keep still advance over the glyphs, but
+    // draw them invisible
+    void ShowText( const vector<PdfVariant> &args, const char *keyword, const PlateRouter::MASK &keep, int renderMode )
+    {
+        bool clips = (renderMode >= 4);
+        for ( size_t i = 0; i < m_index.size(); ++i )
+        {
+            PdfOutputDevice &out = Out(i);
+            if ( PlateRouter::Test(keep, m_index[i]) )
+            {
+                WriteOperator(args, keyword, out);
+                m_inked[i] = true;
+            }
+            else
+            {
+                WriteRenderMode(clips ? 7 : 3, out);
+                WriteOperator(args, keyword, out);
+                WriteRenderMode(renderMode, out);
+            }
+            // text clipping applies to all plates
+            if ( m_inText && (clips || PlateRouter::Test(keep, m_index[i])) )
+                m_text[i].marked = true;
+
+            // " also sets the word and character spacing
+            if ( m_inText && (keyword[0] == '"') && (args.size() == 3) )
+            {
+                WriteOperator(vector<PdfVariant>(1, args[0]), "Tw", *m_text[i].textStateDevice);
+                WriteOperator(vector<PdfVariant>(1, args[1]), "Tc", *m_text[i].textStateDevice);
+            }
+        }
+    }
+
+    // A plate showing none of the text object only keeps the state it set.
+    // Its text state, the font above all, is held back until the plate shows
+    // text again, so a plate without text does not name the fonts.
+    void EndText( const vector<PdfVariant> &args, const char *keyword )
+    {
+        if (!m_inText)
+            return;
+        for ( size_t i = 0; i < m_index.size(); ++i )
+        {
+            TEXT_OBJECT &text = m_text[i];
+            if (text.marked)
+            {
+                WriteOperator(args, keyword, *text.textDevice);
+                WritePendingState(i);
+                m_devices[i]->Write( text.text.GetBuffer(), text.textDevice->GetLength() );
+            }
+            else
+            {
+                m_devices[i]->Write( text.state.GetBuffer(), text.stateDevice->GetLength() );
+                m_pending[i].back().ops.append( text.textState.GetBuffer(), text.textStateDevice->GetLength() );
+            }
+        }
+        m_text.clear();
+        m_inText = false;
+    }
+
+    // sh, or scn with a shading pattern: the operand at position operand names
+    // the resource, plates drawing a copy get the copy's name
+    void Shading( const vector<PdfVariant> &args, const char *keyword, const SHADING_ROUTE &route, size_t operand )
+    {
+        for ( size_t i = 0; i < m_devices.size(); ++i )
+        {
+            if ( !PlateRouter::Test(route.keep, m_index[i]) )
+                continue;
+            m_inked[i] = true;
+            const string &name = route.names[m_index[i]];
+            if (name.empty())
+            {
+                Write(i, args, keyword, true);
+                continue;
+            }
+            vector<PdfVariant> renamed(args);
+            renamed[operand] = PdfName(name);
+            Write(i, renamed, keyword, true);
+        }
+    }
+
+    // A path in a zero tint is held back while its plate has no ink on the
+    // page: there is nothing for it to knock out, so it is dropped at its end
+    // unless it clips or paints nothing anyway
+    void Paint( const vector<PdfVariant> &args, const char *keyword, const PlateRouter::MASK &keep,
+                const vector<float> &tints, bool pathOpen, bool pathEnd )
+    {
+        for ( size_t i = 0; i < m_index.size(); ++i )
+        {
+            if (!pathOpen)
+            {
+                if (IsTextState(keyword))
+                {
+                    // outside text objects text state waits for the next text shown
+                    PdfRefCountedBuffer buffer;
+                    PdfOutputDevice device(&buffer);
+                    WriteOperator(args, keyword, device);
+                    m_pending[i].back().ops.append( buffer.GetBuffer(), device.GetLength() );
+                    continue;
+                }
+                WriteOperator(args, keyword, Out(i));
+                if ( keyword && (strcmp(keyword, "EI") == 0) )
+                    m_inked[i] = true;
+                if ( keyword && (strcmp(keyword, "q") == 0) )
+                    m_pending[i].emplace_back();
+                else if ( keyword && (strcmp(keyword, "Q") == 0) && (m_pending[i].size() > 1) )
+                    RestorePendingState(i);
+                continue;
+            }
+            if ( !PlateRouter::Test(keep, m_index[i]) )
+                continue;
+
+            float tint = tints[m_index[i]];
+            bool paints = pathEnd && (strcmp(keyword, "n") != 0);
+            if ( (tint != 0) || m_inked[i] )
+            {
+                WriteOperator(args, keyword, Out(i));
+                if (paints)
+                {
+                    if (tint >= 0)
+                        ++m_tints[i].counts[TintBucket(tint)];
+                    m_inked[i] = true;
+                }
+                continue;
+            }
+
+            HELD_PATH &held = m_held[i];
+            if (!held.device)
+                held.device.reset( new PdfOutputDevice(&held.buffer) );
+            WriteOperator(args, keyword, *held.device);
+            if ( keyword && (keyword[0] == 'W') )
+                held.clips = true;
+            if (!pathEnd)
+                continue;
+            if ( held.clips || !paints )
+                Out(i).Write( held.buffer.GetBuffer(), held.device->GetLength() );
+            else
+                ++m_tints[i].dropped;
+            if (paints)
+                ++m_tints[i].counts[0];
+            held = HELD_PATH();
+        }
+    }
+
+    void Finish( vector<string> &pages )
+    {
+        for ( size_t i = 0; i < m_devices.size(); ++i )
+        {
+            if (m_devices[i]->GetLength())
+                pages[m_index[i]].assign( m_buffers[i].GetBuffer(), m_devices[i]->GetLength() );
+        }
+        m_devices.clear();
+        m_buffers.clear();
+    }
+
+private:
+    struct TEXT_OBJECT {
+        PdfRefCountedBuffer text;       // the whole object, written when the plate shows some of it
+        PdfRefCountedBuffer state;      // only what outlives ET, written otherwise
+        PdfRefCountedBuffer textState;  // the text state operators that outlive ET, held back otherwise
+        unique_ptr<PdfOutputDevice> textDevice, stateDevice, textStateDevice;
+        bool marked;
+
+        TEXT_OBJECT() : marked(false) {}
+    };
+
+    // Text state operators a plate has not written yet, one level per q of
+    // the page. A level written inside a deeper q is undone by its Q, and
+    // written again when text is shown after it.
+    struct PENDING_STATE {
+        string ops;
+        size_t writtenAt;       // the q depth the ops are written at, 0 when not written
+
+        PENDING_STATE() : writtenAt(0) {}
+    };
+
+    struct HELD_PATH {
+        PdfRefCountedBuffer buffer;
+        unique_ptr<PdfOutputDevice> device;     // NULL when no path is held
+        bool clips;
+
+        HELD_PATH() : clips(false) {}
+    };
+
+    static size_t TintBucket( float tint )
+    {
+        if (tint <= 0)
+            return 0;
+        size_t bucket = static_cast<size_t>(tint * 10 + 0.9999f);
+        return max<size_t>( 1, min<size_t>(10, bucket) );
+    }
+
+    PdfOutputDevice &Out( size_t i )
+    {
+        return m_inText ? *m_text[i].textDevice : *m_devices[i];
+    }
+
+    void Write( size_t i, const vector<PdfVariant> &args, const char *keyword, bool persists )
+    {
+        WriteOperator(args, keyword, Out(i));
+        if ( m_inText && persists )
+            WriteOperator(args, keyword, IsTextState(keyword) ? *m_text[i].textStateDevice : *m_text[i].stateDevice);
+    }
+
+    // Tc, Tw, Tz, TL, Tf, Tr and Ts
+    static bool IsTextState( const char *keyword )
+    {
+        return keyword && (keyword[0] == 'T') && keyword[1] && strchr("cwzLfrs", keyword[1]) && !keyword[2];
+    }
+
+    // before text a plate shows: the text state held back in this q and
+    // those around it
+    void WritePendingState( size_t i )
+    {
+        vector<PENDING_STATE> &levels = m_pending[i];
+        size_t depth = levels.size();
+        for ( size_t l = 0; l < depth; ++l )
+        {
+            PENDING_STATE &level = levels[l];
+            if ( (l + 1 < depth) && level.writtenAt )
+                continue;
+            m_devices[i]->Write( level.ops.data(), level.ops.size() );
+            if (l + 1 < depth)
+                level.writtenAt = depth;
+            else
+                level.ops.clear();
+        }
+    }
+
+    // Q drops the state held back since its q, and undoes what was written
+    // of the outer levels inside it
+    void RestorePendingState( size_t i )
+    {
+        vector<PENDING_STATE> &levels = m_pending[i];
+        size_t depth = levels.size();
+        levels.pop_back();
+        for ( PENDING_STATE &level : levels )
+        {
+            if (level.writtenAt >= depth)
+                level.writtenAt = 0;
+        }
+    }
+
+    static void WriteRenderMode( int mode, PdfOutputDevice &device )
+    {
+        WriteOperator(vector<PdfVariant>(1, PdfVariant(static_cast<pdf_int64>(mode))), "Tr", device);
+    }
+
+    vector<size_t> m_index;         // position in the plate list
+    vector<int> m_channel;
+    vector<PdfRefCountedBuffer> m_buffers;
+    vector<unique_ptr<PdfOutputDevice>> m_devices;
+    vector<TEXT_OBJECT> m_text;
+    bool m_inText = false;
+    vector<bool> m_inked;           // the plate painted something on the page
+    vector<HELD_PATH> m_held;
+    vector<TINT_HISTOGRAM> m_tints;
+    vector<vector<PENDING_STATE>> m_pending;
+};
+
+class SeparationPolicy
+// Writes every plate in one pass, the plates are grouped by kind so each
+// group's behaviour is fixed at compile time
+{
+public:
+    static const bool writes = true;
+
+    explicit SeparationPolicy( const vector<PLATE*> &plates ) : m_count(plates.size())
+    {
+        for ( size_t p = 0; p < plates.size(); ++p )
+        {
+            if (plates[p]->kind == PLATE_SPOT)
+                m_spots.Add(p, -1);
+            else if (plates[p]->kind == PLATE_PROCESS)
+                m_process.Add(p, plates[p]->channel);
+            else
+                m_remaining.Add(p, -1);
+        }
+    }
+
+    void BeginPage()
+    {
+        m_spots.BeginPage();
+        m_process.BeginPage();
+        m_remaining.BeginPage();
+    }
+
+    void EndPage( vector<TINT_HISTOGRAM> &tints )
+    {
+        tints.assign(m_count, TINT_HISTOGRAM());
+        m_spots.EndPage(tints);
+        m_process.EndPage(tints);
+        m_remaining.EndPage(tints);
+    }
+
+    void Begin()
+    {
+        m_spots.Begin();
+        m_process.Begin();
+        m_remaining.Begin();
+    }
+
+    void Color( const vector<PdfVariant> &args, const char *keyword, bool cmykValues, const string & )
+    {
+        m_spots.Color(args, keyword, cmykValues);
+        m_process.Color(args, keyword, cmykValues);
+        m_remaining.Color(args, keyword, cmykValues);
+    }
+
+    void Image( const vector<PdfVariant> &args, const char *keyword )
+    {
+        m_spots.Image(args, keyword);
+        m_process.Image(args, keyword);
+        m_remaining.Image(args, keyword);
+    }
+
+    void InlineImage( const char *data, size_t size, const PlateRouter::MASK *keep, bool last )
+    {
+        m_spots.InlineImage(data, size, keep, last);
+        m_process.InlineImage(data, size, keep, last);
+        m_remaining.InlineImage(data, size, keep, last);
+    }
+
+    void BeginText( const vector<PdfVariant> &args, const char *keyword )
+    {
+        m_spots.BeginText(args, keyword);
+        m_process.BeginText(args, keyword);
+        m_remaining.BeginText(args, keyword);
+    }
+
+    void TextState( const vector<PdfVariant> &args, const char *keyword, bool persists )
+    {
+        m_spots.TextState(args, keyword, persists);
+        m_process.TextState(args, keyword, persists);
+        m_remaining.TextState(args, keyword, persists);
+    }
+
+    void ShowText( const vector<PdfVariant> &args, const char *keyword, const PlateRouter::MASK &keep,
+                   int renderMode, const string & )
+    {
+        m_spots.ShowText(args, keyword, keep, renderMode);
+        m_process.ShowText(args, keyword, keep, renderMode);
+        m_remaining.ShowText(args, keyword, keep, renderMode);
+    }
+
+    void EndText( const vector<PdfVariant> &args, const char *keyword )
+    {
+        m_spots.EndText(args, keyword);
+        m_process.EndText(args, keyword);
+        m_remaining.EndText(args, keyword);
+    }
+
+    void Shading( const vector<PdfVariant> &args, const char *keyword, const SHADING_ROUTE &route, size_t operand )
+    {
+        m_spots.Shading(args, keyword, route, operand);
+        m_process.Shading(args, keyword, route, operand);
+        m_remaining.Shading(args, keyword, route, operand);
+    }
+
+    void Paint( const vector<PdfVariant> &args, const char *keyword, const PlateRouter::MASK &keep,
+                const vector<float> &tints, bool pathOpen, bool pathEnd, const string & )
+    {
+        m_spots.Paint(args, keyword, keep, tints, pathOpen, pathEnd);
+        m_process.Paint(args, keyword, keep, tints, pathOpen, pathEnd);
+        m_remaining.Paint(args, keyword, keep, tints, pathOpen, pathEnd);
+    }
+
+    void Finish( vector<string> &pages )
+    {
+        pages.assign(m_count, string());
+        m_spots.Finish(pages);
+        m_process.Finish(pages);
+        m_remaining.Finish(pages);
+    }
+
+private:
+    size_t m_count;
+    PlateGroup<SpotPlateTraits> m_spots;
+    PlateGroup<ProcessPlateTraits> m_process;
+    PlateGroup<RemainingPlateTraits> m_remaining;
+};
+
+class InventoryPolicy
+// Writes nothing, only records the color spaces paths and text are painted in
+{
+public:
+    static const bool writes = false;
+
+    void Color( const vector<PdfVariant> &, const char *, bool, const string & ) {}
+    void Image( const vector<PdfVariant> &, const char * ) {}
+    void InlineImage( const char *, size_t, const PlateRouter::MASK *, bool ) {}
+    void BeginText( const vector<PdfVariant> &, const char * ) {}
+    void TextState( const vector<PdfVariant> &, const char *, bool ) {}
+    void EndText( const vector<PdfVariant> &, const char * ) {}
+    void Shading( const vector<PdfVariant> &, const char *, const SHADING_ROUTE &, size_t ) {}
+
+    void ShowText( const vector<PdfVariant> &, const char *, const PlateRouter::MASK &, int renderMode,
+                   const string &csName )
+    {
+        if ( (renderMode % 4) != 3 )
+            painted.insert(csName);
+    }
+
+    void Paint( const vector<PdfVariant> &, const char *, const PlateRouter::MASK &, const vector<float> &,
+                bool pathOpen, bool, const string &csName )
+    {
+        if (pathOpen)
+            painted.insert(csName);
+    }
+
+    set<string> painted;
+};
+
+struct COLOR_STATE {
+    // the part of the graphics state q and Q save and restore
+    PlateRouter::MASK keep;         // plates keeping the paths painted with the current color
+    PlateRouter::MASK fillKeep;     // the same for the fill and stroke colors text is shown in
+    PlateRouter::MASK strokeKeep;
+    vector<float> tints;            // of the current color per plate, see PlateRouter::Tints
+    string csName;
+    string csFamily;                // of csName, see DeviceFamily
+    int renderMode;                 // Tr
+
+    explicit COLOR_STATE( const PlateRouter &router )
+        : keep(router.Initial()), fillKeep(keep), strokeKeep(keep), tints(router.InitialTints()), renderMode(0) {}
+};
+
+struct REWRITE_STATE : COLOR_STATE {
+    // carried from one segment of a page to the next
+    vector<PdfVariant> args;
+    vector<COLOR_STATE> saved;
+    bool insidePath;
+    bool insideText;
+    bool imageMask;                 // the inline image going on in parts is a stencil mask
+    const SHADING_TABLE *shadings;  // of the page, NULL when there are none
+    const SHADING_TABLE *patterns;
+    const SPACE_TABLE *spaces;
+
+    explicit REWRITE_STATE( const PlateRouter &router )
+        : COLOR_STATE(router), insidePath(false), insideText(false), imageMask(false), shadings(NULL),
+          patterns(NULL), spaces(NULL) {}
+};
+
+PlateRouter::MASK TextKeep( const REWRITE_STATE &state )
+// Plates keeping text shown in the current render mode
+{
+    switch (state.renderMode % 4)
+    {
+    case 0:
+        return state.fillKeep;
+    case 1:
+        return state.strokeKeep;
+    case 2:
+    {
+        PlateRouter::MASK both(state.fillKeep);
+        for ( size_t w = 0; w < both.size() && w < state.strokeKeep.size(); ++w )
+            both[w] |= state.strokeKeep[w];
+        return both;
+    }
+    }
+    return PlateRouter::MASK(state.fillKeep.size(), 0);
+}
+
+const SHADING_ROUTE *FindShading( const SHADING_TABLE *table, const PdfVariant &name )
+{
+    if ( (table == NULL) || !name.IsName() )
+        return NULL;
+    SHADING_TABLE::const_iterator it = table->find( name.GetName().GetEscapedName() );
+    return (it == table->end()) ? NULL : &it->second;
+}
+
+const string &DeviceFamily( const SPACE_TABLE *spaces, const string &name )
+// DeviceCMYK, DeviceGray or DeviceRGB for those and the named spaces based
+// on them, the colorant for a Separation of a process colorant, empty for
+// any other color space
+{
+    static const string none;
+    if ( (name == "DeviceCMYK") || (name == "DeviceGray") || (name == "DeviceRGB") )
+        return name;
+    if (spaces == NULL)
+        return none;
+    SPACE_TABLE::const_iterator it = spaces->find(name);
+    return (it == spaces->end()) ? none : it->second;
+}
+
+template <class Policy>
+void RewriteContents( PdfContentsTokenizer &tokenizer, PlateRouter &router, Policy &policy, REWRITE_STATE &state )
+// The rewrite kernel, instantiated once per policy. Keywords are classified
+// once, and the plate decisions are made by the policy at compile time.
+{
+    EPdfContentsType t;
+    const char* pszKeyword;
+    PdfVariant var;
+    vector<PdfVariant> &args = state.args;
+    PlateRouter::MASK &keep = state.keep;
+    bool &is_inside_path = state.insidePath;
+    string &cur_cs_name = state.csName;
+    bool &inside_text = state.insideText;
+
+    while( tokenizer.ReadNext(t, pszKeyword, var) )
+    {
+        if (t == ePdfContentsType_Variant)
+        {
+            args.push_back(var);
+            continue;
+        }
+        CheckStop();
+        if (t == ePdfContentsType_ImageData)
+        {
+            // only an inline image the segmenter could not cut out, one
+            // missing its EI, comes here; its data is only needed by plates that write
+            if (Policy::writes)
+                args.push_back(var);
+            continue;
+        }
+        if (t != ePdfContentsType_Keyword)
+            continue;
+
+        CONTENT_OP op = ClassifyOperator(pszKeyword);
+
+        if (op == OP_SAVE)
+            state.saved.push_back( static_cast<const COLOR_STATE&>(state) );
+        else if ( (op == OP_RESTORE) && !state.saved.empty() )
+        {
+            static_cast<COLOR_STATE&>(state) = move(state.saved.back());
+            state.saved.pop_back();
+        }
+
+        // the color state is tracked everywhere, also inside text objects,
+        // upper case operators set the stroke color
+        bool is_device = (op == OP_CMYK) || (op == OP_GRAY) || (op == OP_RGB);
+        bool is_color = (op == OP_COLOR_SPACE) || (op == OP_COLOR) || is_device;
+        PlateRouter::MASK &text_keep = isupper(pszKeyword[0]) ? state.strokeKeep : state.fillKeep;
+        if ( (op == OP_COLOR_SPACE) && !args.empty() && args[0].IsName() )
+        {
+            cur_cs_name = args[0].GetName().GetEscapedName();
+            state.csFamily = DeviceFamily(state.spaces, cur_cs_name);
+            if (Policy::writes)
+                text_keep = keep = router.ColorSpace(cur_cs_name, state.csFamily);
+        }
+        else if ( Policy::writes && (op == OP_CMYK) )
+            text_keep = keep = router.Cmyk();
+        else if ( Policy::writes && (op == OP_GRAY) )
+            text_keep = keep = router.ColorSpace("DeviceGray", "DeviceGray");
+        else if ( Policy::writes && (op == OP_RGB) )
+            text_keep = keep = router.ColorSpace("DeviceRGB", "DeviceRGB");
+        if ( Policy::writes && is_color )
+        {
+            bool cmyk = (op == OP_CMYK) || (!is_device && (state.csFamily == "DeviceCMYK"));
+            bool gray = (op == OP_GRAY) || (!is_device && (state.csFamily == "DeviceGray"));
+            router.Tints(op == OP_COLOR_SPACE, cmyk, gray, cur_cs_name, is_device ? string() : state.csFamily,
+                         args, state.tints);
+        }
+        if ( (op == OP_TEXT_RENDER) && !args.empty() && args[0].IsNumber() )
+            state.renderMode = static_cast<int>(args[0].GetNumber()) & 7;
+
+        // a shading pattern fills with what its shading keeps
+        const SHADING_ROUTE *pattern = NULL;
+        if ( (op == OP_COLOR) && (cur_cs_name == "Pattern") && !args.empty() )
+            pattern = FindShading(state.patterns, args.back());
+        if ( Policy::writes && pattern )
+        {
+            text_keep = keep = pattern->keep;
+            state.tints.assign(state.tints.size(), -1);
+        }
+
+        // text objects: state goes to every plate, text to the plates keeping its color
+        if (op == OP_TEXT_BEGIN)
+        {
+            inside_text = true;
+            policy.BeginText(args, pszKeyword);
+            args.clear();
+            continue;
+        }
+        if (inside_text)
+        {
+            if (op == OP_TEXT_END)
+            {
+                inside_text = false;
+                policy.EndText(args, pszKeyword);
+            }
+            else if (op == OP_TEXT_SHOW)
+            {
+                if (Policy::writes)
+                    policy.ShowText(args, pszKeyword, TextKeep(state), state.renderMode, cur_cs_name);
+                else
+                    policy.ShowText(args, pszKeyword, keep, state.renderMode, cur_cs_name);
+            }
+            else if (pattern)
+                policy.Shading(args, pszKeyword, *pattern, args.size() - 1);
+            else if (is_color)
+            {
+                bool cmyk_values = (op == OP_CMYK) || ((op == OP_COLOR) && (state.csFamily == "DeviceCMYK"));
+                policy.Color(args, pszKeyword, cmyk_values, cur_cs_name);
+            }
+            else
+                policy.TextState(args, pszKeyword, op != OP_TEXT_POSITION);
+            args.clear();
+            continue;
+        }
+
+        // raster objects
+        if (op == OP_XOBJECT)
+        {
+            policy.Image(args, pszKeyword);
+            args.clear();
+            continue;
+        }
+
+        if (pattern)
+        {
+            policy.Shading(args, pszKeyword, *pattern, args.size() - 1);
+            args.clear();
+            continue;
+        }
+        if ( (op == OP_SHADING) && !args.empty() )
+        {
+            const SHADING_ROUTE *shading = FindShading(state.shadings, args[0]);
+            if (shading)
+            {
+                policy.Shading(args, pszKeyword, *shading, 0);
+                args.clear();
+                continue;
+            }
+        }
+
+        if (is_color)
+        {
+            bool cmyk_values = (op == OP_CMYK) || ((op == OP_COLOR) && (state.csFamily == "DeviceCMYK"));
+            policy.Color(args, pszKeyword, cmyk_values, cur_cs_name);
+            args.clear();
+            continue;
+        }
+
+        // inside path checking
+        if (op == OP_PATH_BEGIN)
+            is_inside_path = true;
+        bool path_open = is_inside_path;
+        if (op == OP_PATH_END)
+            is_inside_path = false;
+
+        policy.Paint(args, pszKeyword, keep, state.tints, path_open, path_open && (op == OP_PATH_END), cur_cs_name);
+        args.clear();
+    }
+}
+
+template <class Policy>
+void RouteInlineImage( const string &segment, size_t header, bool last, Policy &policy, REWRITE_STATE &state )
+// An inline image goes on as its raw bytes, the tokenizer only reads its
+// BI ... ID part to tell a stencil mask, painted in the fill color, from an
+// image. Plates dropping it never copy its data. The parts of a large image
+// after the first have no header and go where the first went.
+{
+    if (!Policy::writes)
+        return;
+    if (header)
+    {
+        PdfContentsTokenizer tokenizer( segment.data(), header );
+        EPdfContentsType t;
+        const char *keyword;
+        PdfVariant var;
+        string key;
+        state.imageMask = false;
+        while ( tokenizer.ReadNext(t, keyword, var) )
+        {
+            if ( (t == ePdfContentsType_Keyword) && (strcmp(keyword, "ID") == 0) )
+                break;
+            if (t != ePdfContentsType_Variant)
+                continue;
+            if ( var.IsBool() && var.GetBool() && ((key == "IM") || (key == "ImageMask")) )
+                state.imageMask = true;
+            key = var.IsName() ? var.GetName().GetName() : string();
+        }
+    }
+    policy.InlineImage( segment.data(), segment.size(), state.imageMask ? &state.fillKeep : NULL, last );
+}
+
+template <class Policy, class Emit>
+void RewritePage( ContentReader &reader, const SHADING_TABLE *shadings, const SHADING_TABLE *patterns,
+                  const SPACE_TABLE *spaces, PlateRouter &router, Policy &policy, Emit emit )
+// Runs the kernel over the page one segment at a time, emit(false) is called
+// after each segment and emit(true) once the page is done
+{
+    ContentSegmenter segmenter;
+    REWRITE_STATE state( router );
+    state.shadings = shadings;
+    state.patterns = patterns;
+    state.spaces = spaces;
+    string chunk, segment;
+    bool more = true;
+    while (more)
+    {
+        chunk.clear();
+        more = reader.Read(chunk);
+        segmenter.Append(chunk);
+        while ( segmenter.Next(segment, !more) )
+        {
+            size_t header = segmenter.InlineImageHeader();
+            if ( header || segmenter.InlineImageContinued() )
+                RouteInlineImage( segment, header, !segmenter.InlineImageOpen(), policy, state );
+            else
+            {
+                PdfContentsTokenizer tokenizer( segment.data(), segment.size() );
+                RewriteContents( tokenizer, router, policy, state );
+            }
+            emit(false);
+        }
+    }
+
+    // Close a text object left open and write arguments if there are any left
+    if (state.insideText)
+    {
+        policy.EndText(vector<PdfVariant>(), "ET");
+        state.insideText = false;
+    }
+    policy.Paint(state.args, NULL, state.keep, state.tints, false, false, state.csName);
+    emit(true);
+}
+
+class SpotPrescan
+// Finds the pages no selected spot can be painted on without tokenizing
+// them. Their content only changes on the spot and process plates, so with
+// no process plates the remaining plate can take it as it is.
+{
+public:
+    // about what the reader inflates at a time, a larger page is rewritten
+    static const size_t PRESCAN_LIMIT = ContentReader::CHUNK;
+
+    SpotPrescan( const vector<PLATE*> &plates, const vector<SPOT> &selection )
+        : m_plates(plates.size()), m_remaining(plates.size()), m_process(false)
+    {
+        for ( size_t p = 0; p < plates.size(); ++p )
+        {
+            if (plates[p]->kind == PLATE_PROCESS)
+                m_process = true;
+            else if (plates[p]->kind == PLATE_REMAINING)
+                m_remaining = p;
+            else
+                m_spots.push_back(p);
+        }
+        for ( const SPOT &el : selection )
+        {
+            m_ids.push_back(el.csId);
+            m_names.push_back("/" + el.csId);
+        }
+    }
+
+    size_t Plates() const { return m_plates; }
+    // m_plates when the remaining plate is not built
+    size_t Remaining() const { return m_remaining; }
+
+    // Read stage: the shading routes of the page must leave it to the
+    // remaining plate alone, then the /ColorSpace resources decide
+    PRESCAN_MODE Mode( PdfPage *page, const PAGE_JOB &job ) const
+    {
+        if (m_process)
+            return PRESCAN_NONE;
+        for ( const SHADING_TABLE *table : { &job.shadings, &job.patterns } )
+        {
+            for ( const auto &entry : *table )
+            {
+                const SHADING_ROUTE &route = entry.second;
+                for ( size_t p : m_spots )
+                {
+                    if ( PlateRouter::Test(route.keep, p) )
+                        return PRESCAN_NONE;
+                }
+                if ( (m_remaining < m_plates)
+                     && (!PlateRouter::Test(route.keep, m_remaining) || !route.names[m_remaining].empty()) )
+                    return PRESCAN_NONE;
+            }
+        }
+
+        PdfObject *res = page->GetResources();
+        PdfObject *spaces = (res && res->IsDictionary()) ? res->GetIndirectKey( "ColorSpace" ) : NULL;
+        if ( (spaces == NULL) || !spaces->IsDictionary() )
+            return PRESCAN_VERBATIM;
+        for ( const string &id : m_ids )
+        {
+            if ( spaces->GetDictionary().HasKey(id) )
+                return PRESCAN_SEARCH;
+        }
+        return PRESCAN_VERBATIM;
+    }
+
+    // Rewrite stage: true if data, from about position from on, may name a
+    // selected spot color space. std::string::find runs on memchr, which the
+    // C library vectorises. A # in a name could escape a spot name, so it
+    // counts as a find, as does a name cut off at the end of data.
+    bool Find( const string &data, size_t from ) const
+    {
+        for ( const string &name : m_names )
+        {
+            size_t start = (from > name.size()) ? from - name.size() : 0;
+            for ( size_t pos = data.find(name, start); pos != string::npos; pos = data.find(name, pos + 1) )
+            {
+                size_t end = pos + name.size();
+                if ( (end == data.size()) || !PdfTokenizer::IsRegular(data[end]) )
+                    return true;
+            }
+        }
+        for ( size_t pos = data.find('#', from); pos != string::npos; pos = data.find('#', pos + 1) )
+        {
+            size_t i = pos;
+            while ( (i > 0) && PdfTokenizer::IsRegular(data[i - 1]) )
+                --i;
+            if ( (i > 0) && (data[i - 1] == '/') )
+                return true;
+        }
+        return false;
+    }
+
+private:
+    size_t m_plates;
+    size_t m_remaining;
+    bool m_process;
+    vector<size_t> m_spots;
+    vector<string> m_ids;           // resource names of the selected spots
+    vector<string> m_names;         // as they are written in content
+};
+
+bool PassVerbatim( ContentReader &reader, const PAGE_JOB &job, const SpotPrescan &prescan,
+                   BoundedQueue<PAGE_JOB_PTR> &out )
+// The fast path: the remaining plate takes the content as it is, the other
+// plates stay empty and nothing is tokenized. A page that has to be searched
+// first is held, up to PRESCAN_LIMIT bytes; a find or a larger page puts
+// what was read back for the rewrite.
+{
+    string data;
+    bool more = true;
+    if (job.prescan == PRESCAN_SEARCH)
+    {
+        size_t scanned = 0;
+        while (more)
+        {
+            more = reader.Read(data);
+            if ( prescan.Find(data, scanned) || (data.size() > SpotPrescan::PRESCAN_LIMIT) )
+            {
+                reader.PutBack(data);
+                return false;
+            }
+            scanned = data.size();
+        }
+    }
+
+    // parts end at whitespace, so no name is cut for the compress stage
+    do
+    {
+        if (more)
+            more = reader.Read(data);
+        size_t cut = data.size();
+        while ( more && (cut > 0) && !PdfTokenizer::IsWhitespace(data[cut - 1]) )
+            --cut;
+        if ( more && (cut == 0) )
+            continue;
+
+        PAGE_JOB_PTR part( new PAGE_JOB(job.pageNum) );
+        part->last = !more;
+        part->plates.assign(prescan.Plates(), string());
+        if (prescan.Remaining() < prescan.Plates())
+            part->plates[prescan.Remaining()].assign(data, 0, cut);
+        if (part->last)
+            part->tints.assign(prescan.Plates(), TINT_HISTOGRAM());
+        data.erase(0, cut);
+        out.Push(move(part));
+    }
+    while (more);
+    return true;
+}
+
+void RemoveObjectsExcept( BoundedQueue<PAGE_JOB_PTR> &in, BoundedQueue<PAGE_JOB_PTR> &out,
+                          SeparationPolicy &policy, PlateRouter &router, const SpotPrescan &prescan )
+// Rewrite stage: one tokenizer pass over the page produces the content of
+// every plate, handed on in parts while the page is read
+{
+    PAGE_JOB_PTR job;
+    while ( in.Pop(job) )
+    {
+        if ( job->cached || job->error )
+        {
+            out.Push(move(job));
+            continue;
+        }
+        try
+        {
+            ContentReader reader( job->sources );
+            if ( (job->prescan == PRESCAN_NONE) || !PassVerbatim(reader, *job, prescan, out) )
+            {
+                policy.BeginPage();
+                policy.Begin();
+                RewritePage( reader, &job->shadings, &job->patterns, &job->spaces, router, policy, [&](bool last)
+                {
+                    PAGE_JOB_PTR part( new PAGE_JOB(job->pageNum) );
+                    part->last = last;
+                    policy.Finish( part->plates );
+                    if (last)
+                        policy.EndPage( part->tints );
+                    if (!last)
+                        policy.Begin();
+                    out.Push(move(part));
+                } );
+            }
+        }
+        catch ( ... )
+        {
+            PAGE_JOB_PTR failed( new PAGE_JOB(job->pageNum) );
+            failed->error = current_exception();
+            out.Push(move(failed));
+        }
+        // the page's streams are done with, before waiting for the next one
+        job.reset();
+    }
+    out.Close();
+}
+
+string PageCacheKey( const PLATE &plate, int page_num )
+// Rewritten page streams are cached on their own, they survive changes
+// that only affect the writer
+{
+    return Sha256Hex( plate.key + "\npage\n" + to_string(page_num) );
+}
+
+void CollectNames( const string &content, set<string> &names )
+// Names in rewritten content. A name inside a string or image data is taken
+// as well, which at worst keeps a resource that could have gone.
+{
+    size_t size = content.size();
+    for ( size_t i = 0; i < size; )
+    {
+        if (content[i++] != '/')
+            continue;
+        size_t start = i;
+        while ( (i < size) && PdfTokenizer::IsRegular(content[i]) )
+            ++i;
+        if (i > start)
+            names.insert(content.substr(start, i - start));
+    }
+}
+
+string JoinNames( const set<string> &names )
+{
+    string list;
+    for ( const string &name : names )
+        list += name + "\n";
+    return list;
+}
+
+void SplitNames( const string &list, set<string> &names )
+{
+    istringstream lines(list);
+    string name;
+    while ( getline(lines, name) )
+        names.insert(name);
+}
+
+string JoinTints( const TINT_HISTOGRAM &tints )
+{
+    ostringstream list;
+    for ( unsigned long count : tints.counts )
+        list << count << " ";
+    list << tints.dropped << "\n";
+    return list.str();
+}
+
+bool SplitTints( const string &list, TINT_HISTOGRAM &tints )
+{
+    istringstream values(list);
+    for ( unsigned long &count : tints.counts )
+        values >> count;
+    values >> tints.dropped;
+    return !values.fail();
+}
+
+void DeflateAppend( z_stream &stream, const string &data, string &deflated, int flush )
+{
+    const size_t CHUNK = 1 << 16;
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = data.size();
+    int ret;
+    do
+    {
+        size_t start = deflated.size();
+        deflated.resize(start + CHUNK);
+        stream.next_out = reinterpret_cast<Bytef*>(&deflated[start]);
+        stream.avail_out = CHUNK;
+        ret = deflate(&stream, flush);
+        if (ret == Z_STREAM_ERROR)
+            PODOFO_RAISE_ERROR( ePdfError_Flate );
+        deflated.resize(start + CHUNK - stream.avail_out);
+    } while ( (stream.avail_out == 0) || ((flush == Z_FINISH) && (ret != Z_STREAM_END)) );
+}
+
+class PageDeflater
+// Deflates the parts of a page into one stream per plate as they arrive
+{
+public:
+    explicit PageDeflater( size_t plates ) : m_streams(plates), m_open(false) {}
+    ~PageDeflater() { Abort(); }
+
+    // the deflated page once its last part is added
+    PAGE_JOB_PTR Add( PAGE_JOB &part )
+    {
+        if (!m_open)
+        {
+            for ( z_stream &stream : m_streams )
+            {
+                memset(&stream, 0, sizeof(stream));
+                if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+                    PODOFO_RAISE_ERROR( ePdfError_Flate );
+            }
+            m_open = true;
+            m_page.reset( new PAGE_JOB(part.pageNum) );
+            m_page->plates.assign(m_streams.size(), string());
+            m_page->names.assign(m_streams.size(), set<string>());
+        }
+
+        for ( size_t p = 0; p < m_streams.size(); ++p )
+        {
+            CollectNames( part.plates[p], m_page->names[p] );
+            DeflateAppend( m_streams[p], part.plates[p], m_page->plates[p], part.last ? Z_FINISH : Z_NO_FLUSH );
+        }
+        if (!part.last)
+            return PAGE_JOB_PTR();
+        m_page->tints = move(part.tints);
+        Abort();
+        return move(m_page);
+    }
+
+    void Abort()
+    {
+        if (!m_open)
+            return;
+        for ( z_stream &stream : m_streams )
+            deflateEnd(&stream);
+        m_open = false;
+    }
+
+private:
+    vector<z_stream> m_streams;
+    bool m_open;
+    PAGE_JOB_PTR m_page;
+};
+
+void CompressPages( BoundedQueue<PAGE_JOB_PTR> &in, BoundedQueue<PAGE_JOB_PTR> &out, size_t plates )
+// Compression stage: a whole plain page is never held, its parts are
+// deflated as the rewriter hands them on
+{
+    PageDeflater deflater( plates );
+    PAGE_JOB_PTR part;
+    bool skip = false;              // rest of a page that failed here
+    while ( in.Pop(part) )
+    {
+        if (skip)
+        {
+            skip = !part->last;
+            continue;
+        }
+        if ( part->cached || part->error )
+        {
+            deflater.Abort();
+            out.Push(move(part));
+            continue;
+        }
+        try
+        {
+            PAGE_JOB_PTR page = deflater.Add( *part );
+            if (page)
+                out.Push(move(page));
+        }
+        catch ( ... )
+        {
+            deflater.Abort();
+            PAGE_JOB_PTR failed( new PAGE_JOB(part->pageNum) );
+            failed->error = current_exception();
+            out.Push(move(failed));
+            skip = !part->last;
+        }
+    }
+    out.Close();
+}
+
+void MergePageContents( PdfMemDocument &pdf )
+// Every page gets a single content stream to hold its rewritten contents. A
+// /Contents array is replaced by a new stream, and the original streams are
+// removed once no page refers to them, so they are not written with a plate.
+{
+    set<PdfReference> originals;
+    set<PdfReference> kept;
+    for( int page_num = 0; page_num < pdf.GetPageCount(); page_num++ )
+    {
+        PdfObject *page = pdf.GetPage( page_num )->GetObject();
+        PdfObject *key = page->GetDictionary().GetKey( PdfName::KeyContents );
+        PdfObject *contents = page->GetIndirectKey( PdfName::KeyContents );
+        if ( contents && contents->HasStream() )
+        {
+            kept.insert(contents->Reference());
+            continue;
+        }
+
+        if ( key && key->IsReference() )
+            originals.insert(key->GetReference());
+        if ( contents && contents->IsArray() )
+        {
+            const PdfArray &streams = contents->GetArray();
+            for ( size_t i = 0; i < streams.GetSize(); ++i )
+            {
+                if (streams[i].IsReference())
+                    originals.insert(streams[i].GetReference());
+            }
+        }
+        PdfObject *stream = pdf.GetObjects().CreateObject();
+        page->GetDictionary().AddKey( PdfName::KeyContents, stream->Reference() );
+    }
+
+    for ( const PdfReference &ref : originals )
+    {
+        if (kept.count(ref) == 0)
+            delete pdf.GetObjects().RemoveObject( ref );
+    }
+}
+
+void DetachPageContents( PdfMemDocument &pdf, int first, int count )
+// MergePageContents() for the pages of one --split chunk, written while later
+// pages are separated: the original streams stay, those pages may share them
+// and their content is still being read.
+{
+    for( int page_num = first; page_num < first + count; page_num++ )
+    {
+        PdfObject *stream = pdf.GetObjects().CreateObject();
+        pdf.GetPage( page_num )->GetObject()->GetDictionary().AddKey( PdfName::KeyContents, stream->Reference() );
+    }
+}
+
+void FilterPageResources( PdfMemDocument &pdf, PdfPage *pPage, const PdfObject &original, const set<string> &names,
+                          const map<string, EXTRA_RESOURCE> &extras )
+// The page keeps the named resources its rewritten content uses. Default
+// color spaces apply without being named and always stay. Copies made for
+// the plates, such as split shadings, are added when the content uses them.
+{
+    if (!original.IsDictionary())
+        return;
+
+    PdfDictionary resources = original.GetDictionary();
+    const char *categories[] = { "Font", "XObject", "ColorSpace", "ExtGState", "Pattern", "Shading", "Properties" };
+    for ( const char *category : categories )
+    {
+        const PdfObject *entries = resources.GetKey(category);
+        if ( entries && entries->IsReference() )
+            entries = pdf.GetObjects().GetObject(entries->GetReference());
+        if ( !entries || !entries->IsDictionary() )
+            continue;
+
+        PdfDictionary used;
+        for ( const auto &entry : entries->GetDictionary().GetKeys() )
+        {
+            string name = entry.first.GetEscapedName();
+            if ( names.count(name) || (name.compare(0, 7, "Default") == 0) )
+                used.AddKey(entry.first, *entry.second);
+        }
+        if (used.GetKeys().empty())
+            resources.RemoveKey(category);
+        else
+            resources.AddKey(category, used);
+    }
+
+    for ( const string &name : names )
+    {
+        map<string, EXTRA_RESOURCE>::const_iterator extra = extras.find(name);
+        if (extra == extras.end())
+            continue;
+        PdfObject *entries = resources.GetKey(extra->second.category);
+        if ( !entries || !entries->IsDictionary() )
+        {
+            resources.AddKey(extra->second.category, PdfDictionary());
+            entries = resources.GetKey(extra->second.category);
+        }
+        entries->GetDictionary().AddKey(name, extra->second.ref);
+    }
+    pPage->GetObject()->GetDictionary().AddKey( "Resources", resources );
+}
+
+void LayerPages( PdfMemDocument &pdf, vector<PLATE> &plates, const vector<PdfObject> &resources,
+                 const map<string, EXTRA_RESOURCE> &extras )
+// One file holding every plate as an optional content group. Each page draws
+// all plates, each in its own marked content sequence, and the resources the
+// plates share are stored once. The remaining plate is drawn first, at the
+// bottom, then the process plates and the spots on top, as they are printed.
+// Each layer starts in overprint mode, so a plate does not knock out the inks
+// of those under it where the viewer simulates overprint. The remaining plate
+// holds the process colors already, their own layers start switched off.
+{
+    vector<size_t> order;
+    for ( PLATE_KIND kind : { PLATE_REMAINING, PLATE_PROCESS, PLATE_SPOT } )
+    {
+        for ( size_t p = 0; p < plates.size(); ++p )
+        {
+            if (plates[p].kind == kind)
+                order.push_back(p);
+        }
+    }
+
+    PdfVecObjects &objects = pdf.GetObjects();
+    PdfObject *overprint = objects.CreateObject("ExtGState");
+    overprint->GetDictionary().AddKey( "OP", PdfObject(true) );
+    overprint->GetDictionary().AddKey( "op", PdfObject(true) );
+    overprint->GetDictionary().AddKey( "OPM", PdfObject(static_cast<pdf_int64>(1)) );
+    PdfArray ocgs, on, off;
+    PdfDictionary properties;
+    vector<PdfReference> begins;
+    for ( size_t p = 0; p < plates.size(); ++p )
+    {
+        PdfObject *ocg = objects.CreateObject("OCG");
+        ocg->GetDictionary().AddKey( "Name", PdfString(reinterpret_cast<const pdf_utf8*>(plates[p].name.c_str())) );
+        ocgs.push_back(ocg->Reference());
+        ((plates[p].kind == PLATE_PROCESS) ? off : on).push_back(ocg->Reference());
+
+        string tag = "pdfseLayer" + to_string(p);
+        properties.AddKey( tag, ocg->Reference() );
+        string begin = "/OC /" + tag + " BDC q /pdfseOverprint gs\n";
+        PdfObject *stream = objects.CreateObject();
+        stream->GetStream()->Set( begin.c_str(), begin.size() );
+        begins.push_back(stream->Reference());
+    }
+    PdfObject *end = objects.CreateObject();
+    end->GetStream()->Set( "Q EMC\n", 6 );
+
+    PdfDictionary config;
+    config.AddKey( "Order", ocgs );
+    config.AddKey( "ON", on );
+    if (!off.empty())
+        config.AddKey( "OFF", off );
+    PdfDictionary oc_properties;
+    oc_properties.AddKey( "OCGs", ocgs );
+    oc_properties.AddKey( "D", config );
+    pdf.GetCatalog()->GetDictionary().AddKey( "OCProperties", oc_properties );
+    if (pdf.GetPdfVersion() < ePdfVersion_1_5)
+        pdf.SetPdfVersion( ePdfVersion_1_5 );
+
+    for( int page_num = 0; page_num < pdf.GetPageCount(); page_num++ )
+    {
+        PdfPage *pPage = pdf.GetPage( page_num );
+        PdfArray contents;
+        set<string> names;
+        for ( size_t p : order )
+        {
+            string &deflated = plates[p].pages[page_num];
+            PdfObject *stream = objects.CreateObject();
+            stream->GetDictionary().AddKey( PdfName::KeyFilter, PdfName("FlateDecode") );
+            PdfInputDevice input( deflated.data(), deflated.size() );
+            stream->GetStream()->SetRawData( &input, deflated.size() );
+            string().swap(deflated);
+
+            contents.push_back(begins[p]);
+            contents.push_back(stream->Reference());
+            contents.push_back(end->Reference());
+            names.insert( plates[p].names[page_num].begin(), plates[p].names[page_num].end() );
+        }
+        pPage->GetObject()->GetDictionary().AddKey( PdfName::KeyContents, contents );
+
+        // the page resources every plate uses, and the layers
+        FilterPageResources( pdf, pPage, resources[page_num], names, extras );
+        PdfDictionary &page = pPage->GetObject()->GetDictionary();
+        if ( !page.HasKey("Resources") || !page.GetKey("Resources")->IsDictionary() )
+            page.AddKey( "Resources", PdfDictionary() );
+        PdfDictionary &page_resources = page.GetKey("Resources")->GetDictionary();
+        PdfDictionary layers = properties;
+        const PdfObject *existing = page_resources.GetKey("Properties");
+        if ( existing && existing->IsDictionary() )
+        {
+            for ( const auto &entry : existing->GetDictionary().GetKeys() )
+                layers.AddKey(entry.first, *entry.second);
+        }
+        page_resources.AddKey( "Properties", layers );
+        PdfDictionary states;
+        existing = page_resources.GetKey("ExtGState");
+        if ( existing && existing->IsDictionary() )
+            states = existing->GetDictionary();
+        states.AddKey( "pdfseOverprint", overprint->Reference() );
+        page_resources.AddKey( "ExtGState", states );
+    }
+}
+
+size_t PagesSize( const PLATE &plate )
+{
+    size_t size = 0;
+    for ( const string &page : plate.pages )
+        size += page.size();
+    return size;
+}
+
+void ReleasePages( PLATE &plate )
+// Frees the deflated pages of a plate and gives their bytes back to the budget
+{
+    memoryBudget.Unreserve( PagesSize(plate) );
+    vector<string>().swap(plate.pages);
+}
+
+void SetPageContents( PdfPage *pPage, const string &deflated )
+{
+    // Set new contents stream, the page has a single one after MergePageContents()
+    PdfObject *contents = pPage->GetObject()->GetIndirectKey( PdfName::KeyContents );
+    contents->GetDictionary().AddKey(PdfName::KeyFilter, PdfName("FlateDecode"));
+    contents->GetDictionary().RemoveKey("DecodeParms");
+    PdfInputDevice input( deflated.data(), deflated.size() );
+    contents->GetStream()->SetRawData( &input, deflated.size() );
+}
+
+void RunPipelineStage( BoundedQueue<PAGE_JOB_PTR> &in, BoundedQueue<PAGE_JOB_PTR> *out,
+                       function<void(PAGE_JOB&)> work )
+// Jobs that failed in an earlier stage are passed on untouched, the error
+// is reported once the pipeline has drained
+{
+    PAGE_JOB_PTR job;
+    while ( in.Pop(job) )
+    {
+        if (!job->error)
+        {
+            try
+            {
+                work(*job);
+            }
+            catch ( ... )
+            {
+                job->error = current_exception();
+            }
+        }
+        if (out)
+            out->Push(move(job));
+        else if (job->error)
+            rethrow_exception(job->error);
+    }
+    if (out)
+        out->Close();
+}
+
+class DeviceFamilies
+// The device color space an ICC based or CIE based color space stands for:
+// from the number of components of an ICC profile, or its /Alternate. A
+// Separation of Cyan, Magenta, Yellow or Black paints that process colorant,
+// its family is the colorant's name. Each space is looked at once, in the
+// read stage as it works on the document.
+{
+public:
+    explicit DeviceFamilies( PdfMemDocument &pdf ) : m_pdf(pdf) {}
+
+    void Resources( const PdfObject *resources, SPACE_TABLE &spaces )
+    {
+        if ( !resources || !resources->IsDictionary() )
+            return;
+        const PdfObject *entries = Resolve( resources->GetDictionary().GetKey("ColorSpace") );
+        if ( !entries || !entries->IsDictionary() )
+            return;
+        for ( const auto &entry : entries->GetDictionary().GetKeys() )
+        {
+            string family = Family( Resolve(entry.second) );
+            if (!family.empty())
+                spaces[entry.first.GetEscapedName()] = family;
+        }
+    }
+
+private:
+    const PdfObject *Resolve( const PdfObject *obj )
+    {
+        if ( obj && obj->IsReference() )
+            return m_pdf.GetObjects().GetObject(obj->GetReference());
+        return obj;
+    }
+
+    string Family( const PdfObject *cs )
+    {
+        if (cs == NULL)
+            return string();
+        map<const PdfObject*, string>::const_iterator it = m_families.find(cs);
+        if (it != m_families.end())
+            return it->second;
+        // an /Alternate naming the space itself ends here
+        m_families[cs] = string();
+
+        string family, kind;
+        const PdfObject *parms = NULL;
+        if (cs->IsName())
+            kind = cs->GetName().GetEscapedName();
+        else if ( cs->IsArray() && (cs->GetArray().GetSize() > 1) && cs->GetArray()[0].IsName() )
+        {
+            kind = cs->GetArray()[0].GetName().GetEscapedName();
+            parms = Resolve(&cs->GetArray()[1]);
+        }
+        if ( (kind == "DeviceCMYK") || (kind == "DeviceGray") || (kind == "DeviceRGB") )
+            family = kind;
+        else if (kind == "CalGray")
+            family = "DeviceGray";
+        else if (kind == "CalRGB")
+            family = "DeviceRGB";
+        else if ( (kind == "Separation") && parms && parms->IsName() )
+        {
+            string colorant = UnescapeName( parms->GetName().GetEscapedName() );
+            if (find(PROCESS_NAMES, PROCESS_NAMES + 4, colorant) != PROCESS_NAMES + 4)
+                family = colorant;
+        }
+        else if ( (kind == "ICCBased") && parms && parms->IsDictionary() )
+        {
+            switch ( parms->GetDictionary().GetKeyAsLong("N", 0) )
+            {
+            case 1: family = "DeviceGray"; break;
+            case 3: family = "DeviceRGB"; break;
+            case 4: family = "DeviceCMYK"; break;
+            default: family = Family( Resolve(parms->GetDictionary().GetKey("Alternate")) );
+            }
+        }
+        m_families[cs] = family;
+        return family;
+    }
+
+    PdfMemDocument &m_pdf;
+    map<const PdfObject*, string> m_families;
+};
+
+class ShadingSplitter
+// Decides for every plate what becomes of a shading or shading pattern: drawn
+// as it is, dropped, or drawn from a copy whose color space marks the other
+// plates' colorants as None. The copies stay vector shadings. Each shading is
+// looked at once, and runs in the read stage as it works on the document.
+{
+public:
+    ShadingSplitter( PdfMemDocument &pdf, const vector<PLATE*> &plates, const vector<SPOT> &selection,
+                     map<string, EXTRA_RESOURCE> &extras )
+        : m_pdf(pdf), m_plates(plates), m_extras(extras), m_words((plates.size() + 63) / 64),
+          m_direct(0)
+    {
+        for ( const SPOT &el : selection )
+            m_selected.insert(el.name);
+        for ( const PLATE *plate : plates )
+        {
+            string id = to_string(plate->kind) + "\n" + plate->name;
+            m_tags.push_back( Sha256Hex(id).substr(0, 8) );
+        }
+    }
+
+    void RoutePage( PdfPage *pPage, SHADING_TABLE &shadings, SHADING_TABLE &patterns )
+    {
+        const PdfObject *resources = pPage->GetResources();
+        if ( !resources || !resources->IsDictionary() )
+            return;
+
+        const PdfObject *entries = Resolve( resources->GetDictionary().GetKey("Shading") );
+        if ( entries && entries->IsDictionary() )
+        {
+            for ( const auto &entry : entries->GetDictionary().GetKeys() )
+            {
+                const PdfObject *shading = Resolve(entry.second);
+                if ( shading && shading->IsDictionary() )
+                    shadings[entry.first.GetEscapedName()] = Shading(shading);
+            }
+        }
+
+        entries = Resolve( resources->GetDictionary().GetKey("Pattern") );
+        if ( entries && entries->IsDictionary() )
+        {
+            for ( const auto &entry : entries->GetDictionary().GetKeys() )
+            {
+                const PdfObject *pattern = Resolve(entry.second);
+                if ( pattern && pattern->IsDictionary()
+                     && (pattern->GetDictionary().GetKeyAsLong("PatternType", 0) == 2) )
+                    patterns[entry.first.GetEscapedName()] = Pattern(pattern);
+            }
+        }
+    }
+
+private:
+    enum DECISION { DROP, KEEP, SPLIT };
+
+    const PdfObject *Resolve( const PdfObject *obj )
+    {
+        if ( obj && obj->IsReference() )
+            return m_pdf.GetObjects().GetObject(obj->GetReference());
+        return obj;
+    }
+
+    string Tag( const PdfObject *obj )
+    {
+        // direct objects are numbered in the order they are met, which is
+        // the same in every run over the same pages
+        if (obj->Reference().ObjectNumber())
+            return "R" + to_string(obj->Reference().ObjectNumber()) + "_" + to_string(obj->Reference().GenerationNumber());
+        return "D" + to_string(m_direct++);
+    }
+
+    bool Wants( const PLATE &plate, const string &colorant )
+    {
+        if (plate.kind == PLATE_SPOT)
+            return colorant == plate.spot.name;
+        if (plate.kind == PLATE_PROCESS)
+            return colorant == PROCESS_NAMES[plate.channel];
+        return m_selected.count(colorant) == 0;
+    }
+
+    DECISION Decide( const PdfObject *cs, const PLATE &plate, PdfObject &split )
+    {
+        string family;
+        vector<string> colorants;       // unescaped
+        vector<PdfName> names_as_written;
+        if ( cs && cs->IsName() )
+            family = cs->GetName().GetEscapedName();
+        else if ( cs && cs->IsArray() && (cs->GetArray().GetSize() > 1) && cs->GetArray()[0].IsName() )
+        {
+            family = cs->GetArray()[0].GetName().GetEscapedName();
+            const PdfObject *names = Resolve(&cs->GetArray()[1]);
+            if ( (family == "Separation") && names && names->IsName() )
+                names_as_written.push_back( names->GetName() );
+            else if ( (family == "DeviceN") && names && names->IsArray() )
+            {
+                for ( size_t i = 0; i < names->GetArray().GetSize(); ++i )
+                {
+                    const PdfObject &name = names->GetArray()[i];
+                    names_as_written.push_back( name.IsName() ? name.GetName() : PdfName("None") );
+                }
+            }
+        }
+        if (family == "DeviceCMYK")
+            names_as_written.assign(PROCESS_NAMES, PROCESS_NAMES + 4);
+        else if (family == "DeviceGray")
+            names_as_written.push_back( PdfName("Black") );
+        for ( const PdfName &name : names_as_written )
+            colorants.push_back( UnescapeName(name.GetEscapedName()) );
+
+        // RGB, ICC based, Lab and indexed shadings stay with the remaining plate
+        if (colorants.empty())
+            return (plate.kind == PLATE_REMAINING) ? KEEP : DROP;
+
+        PdfArray kept_names;
+        vector<bool> dropped;
+        size_t kept = 0, marking = 0;
+        for ( size_t i = 0; i < colorants.size(); ++i )
+        {
+            bool wanted = (colorants[i] != "None") && Wants(plate, colorants[i]);
+            marking += (colorants[i] != "None") ? 1 : 0;
+            kept += wanted ? 1 : 0;
+            kept_names.push_back( wanted ? names_as_written[i] : PdfName("None") );
+            dropped.push_back( !wanted && (colorants[i] != "None") );
+        }
+        if (kept == 0)
+            return DROP;
+        if ( (kept == marking) || (family == "DeviceGray") || (family == "Separation") )
+            return KEEP;
+
+        // Viewers draw None colorants through the tint transform, so it
+        // gets a copy that sees zero for the colorants the plate drops
+        PdfArray space;
+        if (family == "DeviceN")
+        {
+            space = cs->GetArray();
+            space[1] = kept_names;
+            const PdfObject *transform = (space.GetSize() > 3) ? Resolve(&cs->GetArray()[3]) : NULL;
+            if (transform)
+                space[3] = ZeroingTransform( transform, space[3], dropped );
+        }
+        else
+        {
+            // DeviceCMYK: the kept channels through an identity tint transform
+            space.push_back( PdfName("DeviceN") );
+            space.push_back( kept_names );
+            space.push_back( PdfName("DeviceCMYK") );
+            space.push_back( ZeroingTransform( NULL, PdfObject(), dropped ) );
+        }
+        split = PdfObject(space);
+        return SPLIT;
+    }
+
+    // PostScript that scales the dropped inputs on the stack to zero: each
+    // turn handles the input on top and rolls it under the others
+    static string ZeroingOps( const vector<bool> &dropped )
+    {
+        string ops;
+        for ( size_t i = dropped.size(); i-- > 0; )
+            ops += string(dropped[i] ? "0 mul " : "") + to_string(dropped.size()) + " 1 roll ";
+        return ops;
+    }
+
+    // A copy of the tint transform with the dropped inputs at zero, NULL
+    // for the identity on CMYK. A type 4 function gets the zeroing in front
+    // of its program, a sampled one encodes those inputs to the sample at
+    // zero. Others are left as they are.
+    PdfObject ZeroingTransform( const PdfObject *function, const PdfObject &original, const vector<bool> &dropped )
+    {
+        string key = to_string( reinterpret_cast<uintptr_t>(function) ) + "\n";
+        for ( bool d : dropped )
+            key += d ? '0' : '1';
+        map<string, PdfReference>::const_iterator it = m_transforms.find(key);
+        if (it != m_transforms.end())
+            return it->second;
+
+        PdfObject *copy = NULL;
+        if (function == NULL)
+        {
+            PdfArray range;
+            for ( int i = 0; i < 8; ++i )
+                range.push_back( PdfObject(static_cast<pdf_int64>(i % 2)) );
+            copy = m_pdf.GetObjects().CreateObject();
+            copy->GetDictionary().AddKey( "FunctionType", PdfObject(static_cast<pdf_int64>(4)) );
+            copy->GetDictionary().AddKey( "Domain", range );
+            copy->GetDictionary().AddKey( "Range", range );
+            string program = "{ " + ZeroingOps(dropped) + "}";
+            copy->GetStream()->Set( program.c_str(), program.size() );
+        }
+        else if ( function->IsDictionary() && function->HasStream()
+                  && (function->GetDictionary().GetKeyAsLong("FunctionType", -1) == 4) )
+        {
+            PdfRefCountedBuffer buffer;
+            PdfOutputDevice device( &buffer );
+            function->GetStream()->GetFilteredCopy( &device );
+            string program( buffer.GetBuffer(), device.GetLength() );
+            size_t open = program.find('{');
+            if (open == string::npos)
+                return original;
+            program.insert( open + 1, " " + ZeroingOps(dropped) );
+            PdfDictionary dict = function->GetDictionary();
+            dict.RemoveKey( PdfName::KeyFilter );
+            dict.RemoveKey( "DecodeParms" );
+            copy = m_pdf.GetObjects().CreateObject( dict );
+            copy->GetStream()->Set( program.c_str(), program.size() );
+        }
+        else if ( function->IsDictionary() && function->HasStream()
+                  && (function->GetDictionary().GetKeyAsLong("FunctionType", -1) == 0) )
+        {
+            const PdfDictionary &dict = function->GetDictionary();
+            const PdfObject *domain = Resolve( dict.GetKey("Domain") );
+            const PdfObject *size = Resolve( dict.GetKey("Size") );
+            const PdfObject *encode = Resolve( dict.GetKey("Encode") );
+            if ( !domain || !domain->IsArray() || (domain->GetArray().GetSize() < 2 * dropped.size())
+                 || !size || !size->IsArray() || (size->GetArray().GetSize() < dropped.size()) )
+                return original;
+            PdfArray zeroed;
+            for ( size_t i = 0; i < dropped.size(); ++i )
+            {
+                double d0 = domain->GetArray()[2 * i].GetReal(), d1 = domain->GetArray()[2 * i + 1].GetReal();
+                double e0 = 0, e1 = size->GetArray()[i].GetReal() - 1;
+                if ( encode && encode->IsArray() && (encode->GetArray().GetSize() >= 2 * dropped.size()) )
+                {
+                    e0 = encode->GetArray()[2 * i].GetReal();
+                    e1 = encode->GetArray()[2 * i + 1].GetReal();
+                }
+                if ( dropped[i] && (d1 != d0) )
+                {
+                    // the sample position input zero, clipped to the domain, maps to
+                    double at = e0 + (min(max(0.0, min(d0, d1)), max(d0, d1)) - d0) * (e1 - e0) / (d1 - d0);
+                    e0 = e1 = at;
+                }
+                zeroed.push_back( PdfObject(e0) );
+                zeroed.push_back( PdfObject(e1) );
+            }
+            copy = Copy(function);
+            copy->GetDictionary().AddKey( "Encode", zeroed );
+        }
+        else
+            return original;
+
+        m_transforms[key] = copy->Reference();
+        return copy->Reference();
+    }
+
+    PdfObject *Copy( const PdfObject *original )
+    {
+        PdfObject *copy = m_pdf.GetObjects().CreateObject( original->GetDictionary() );
+        if (original->HasStream())
+        {
+            PdfRefCountedBuffer buffer;
+            PdfOutputDevice device( &buffer );
+            original->GetStream()->GetCopy( &device );
+            PdfInputDevice input( buffer.GetBuffer(), device.GetLength() );
+            copy->GetStream()->SetRawData( &input, device.GetLength() );
+        }
+        return copy;
+    }
+
+    SHADING_ROUTE Shading( const PdfObject *shading )
+    {
+        map<const PdfObject*, SHADING_ROUTE>::const_iterator it = m_shadings.find(shading);
+        if (it != m_shadings.end())
+            return it->second;
+
+        SHADING_ROUTE route;
+        route.keep.assign(m_words, 0);
+        route.names.assign(m_plates.size(), string());
+        const PdfObject *cs = Resolve( shading->GetDictionary().GetKey("ColorSpace") );
+        string tag = Tag(shading);
+        for ( size_t p = 0; p < m_plates.size(); ++p )
+        {
+            PdfObject split;
+            DECISION decision = Decide(cs, *m_plates[p], split);
+            if (decision == DROP)
+                continue;
+            PlateRouter::Set(route.keep, p);
+            if (decision == KEEP)
+                continue;
+
+            PdfObject *copy = Copy(shading);
+            copy->GetDictionary().AddKey( "ColorSpace", split );
+            string name = "pdfseSh" + tag + "_" + m_tags[p];
+            m_extras[name] = EXTRA_RESOURCE{ "Shading", copy->Reference() };
+            route.names[p] = name;
+        }
+        m_shadings[shading] = route;
+        return route;
+    }
+
+    SHADING_ROUTE Pattern( const PdfObject *pattern )
+    {
+        map<const PdfObject*, SHADING_ROUTE>::const_iterator it = m_patterns.find(pattern);
+        if (it != m_patterns.end())
+            return it->second;
+
+        SHADING_ROUTE route;
+        const PdfObject *shading = Resolve( pattern->GetDictionary().GetKey("Shading") );
+        if ( shading && shading->IsDictionary() )
+            route = Shading(shading);
+        else
+        {
+            route.keep.assign(m_words, 0);
+            route.names.assign(m_plates.size(), string());
+        }
+
+        string tag = Tag(pattern);
+        for ( size_t p = 0; p < m_plates.size(); ++p )
+        {
+            if (route.names[p].empty())
+                continue;
+            PdfObject *copy = Copy(pattern);
+            copy->GetDictionary().AddKey( "Shading", m_extras[route.names[p]].ref );
+            string name = "pdfsePat" + tag + "_" + m_tags[p];
+            m_extras[name] = EXTRA_RESOURCE{ "Pattern", copy->Reference() };
+            route.names[p] = name;
+        }
+        m_patterns[pattern] = route;
+        return route;
+    }
+
+    PdfMemDocument &m_pdf;
+    const vector<PLATE*> &m_plates;
+    map<string, EXTRA_RESOURCE> &m_extras;
+    size_t m_words;
+    set<string> m_selected;         // unescaped spot names
+    vector<string> m_tags;          // per plate, part of the copies' resource names
+    map<const PdfObject*, SHADING_ROUTE> m_shadings;
+    map<const PdfObject*, SHADING_ROUTE> m_patterns;
+    int m_direct;
+    map<string, PdfReference> m_transforms;     // zeroing tint transforms by function and dropped inputs
+};
+
+void SeparatePages( PdfMemDocument &pdf, const vector<PLATE*> &plates, const vector<SPOT> &selection,
+                    const CACHE &cache, map<string, EXTRA_RESOURCE> &extras, function<void(int)> pagesDone )
+// Pages run through a pipeline: the calling thread finds the content streams
+// of the pages ahead, while other pages are inflated, rewritten and deflated
+// in parts. The document is only touched by the calling thread, the other
+// stages read the stream data it points them to. pagesDone, if set, is called
+// on the calling thread with the number of leading pages whose plates are
+// complete, between the pages it reads and once more at the end.
+{
+    BoundedQueue<PAGE_JOB_PTR> rewriteQueue(4), compressQueue(4), collectQueue(4);
+    exception_ptr collectError;
+    atomic<int> collected(0);
+    PlateRouter router( plates, selection );
+    SeparationPolicy policy( plates );
+    ShadingSplitter splitter( pdf, plates, selection, extras );
+    DeviceFamilies families( pdf );
+    SpotPrescan prescan( plates, selection );
+    thread rewriter( RemoveObjectsExcept, ref(rewriteQueue), ref(compressQueue), ref(policy), ref(router),
+                     cref(prescan) );
+    thread compressor( CompressPages, ref(compressQueue), ref(collectQueue), plates.size() );
+    thread collector( [&]()
+    {
+        try
+        {
+            RunPipelineStage( collectQueue, NULL, [&](PAGE_JOB &job)
+            {
+                for ( size_t p = 0; p < plates.size(); ++p )
+                {
+                    if (!job.cached)
+                    {
+                        string key = PageCacheKey(*plates[p], job.pageNum);
+                        string names = JoinNames(job.names[p]);
+                        string tints = JoinTints(job.tints[p]);
+                        CacheStore( cache, key, ".page", job.plates[p].data(), job.plates[p].size() );
+                        CacheStore( cache, key, ".names", names.data(), names.size() );
+                        CacheStore( cache, key, ".tints", tints.data(), tints.size() );
+                    }
+                    // the plate holds its pages until it is written
+                    memoryBudget.Reserve( job.plates[p].size() );
+                    plates[p]->pages[job.pageNum] = move(job.plates[p]);
+                    plates[p]->names[job.pageNum] = move(job.names[p]);
+                    plates[p]->tints.Add(job.tints[p]);
+                }
+                // pages arrive in order, the plates of all before this one are complete
+                collected = job.pageNum + 1;
+            } );
+        }
+        catch ( ... )
+        {
+            collectError = current_exception();
+            PAGE_JOB_PTR job;
+            while ( collectQueue.Pop(job) ) {}
+        }
+    } );
+
+    for ( PLATE *plate : plates )
+    {
+        plate->pages.assign(pdf.GetPageCount(), string());
+        plate->names.assign(pdf.GetPageCount(), set<string>());
+    }
+
+    for( int page_num = 0; page_num < pdf.GetPageCount(); page_num++ )
+    {
+        PAGE_JOB_PTR job( new PAGE_JOB(page_num) );
+        try
+        {
+            CheckStop();
+            PdfPage* pPage = pdf.GetPage( page_num );
+            PODOFO_RAISE_LOGIC_IF( !pPage, "Got null page pointer within valid page range" );
+
+            // also for cached pages: they name the same shading copies
+            splitter.RoutePage( pPage, job->shadings, job->patterns );
+
+            if (!cache.dir.empty())
+            {
+                job->plates.resize(plates.size());
+                job->names.resize(plates.size());
+                job->tints.resize(plates.size());
+                job->cached = true;
+                for ( size_t p = 0; (p < plates.size()) && job->cached; ++p )
+                {
+                    string key = PageCacheKey(*plates[p], page_num);
+                    string names, tints;
+                    job->cached = CacheLoad( cache, key, ".page", job->plates[p] )
+                                  && CacheLoad( cache, key, ".names", names )
+                                  && CacheLoad( cache, key, ".tints", tints )
+                                  && SplitTints( tints, job->tints[p] );
+                    SplitNames( names, job->names[p] );
+                }
+                if (!job->cached)
+                {
+                    job->plates.clear();
+                    job->names.clear();
+                    job->tints.clear();
+                }
+            }
+            if (!job->cached)
+            {
+                PageSources( pPage, job->sources );
+                families.Resources( pPage->GetResources(), job->spaces );
+                job->prescan = prescan.Mode( pPage, *job );
+
+                // the page waits here until it fits the memory budget: its
+                // decoded streams, the chunks inflated and the parts of each plate
+                size_t footprint = 0;
+                for ( const CONTENT_SOURCE &source : job->sources )
+                    footprint += source.size + source.decoded.size();
+                job->footprint = memoryBudget.Acquire( (plates.size() + 1) * (footprint + (1 << 20)) );
+            }
+        }
+        catch ( ... )
+        {
+            job->error = current_exception();
+        }
+        rewriteQueue.Push(move(job));
+        if (pagesDone)
+            pagesDone( collected );
+    }
+    rewriteQueue.Close();
+    rewriter.join();
+    compressor.join();
+    collector.join();
+    if (collectError)
+        rethrow_exception(collectError);
+    if (pagesDone)
+        pagesDone( collected );
+}
+
+struct PAGE_RANGE {
+    string spec;            // --pages, empty for all pages
+    vector<int> numbers;    // input page numbers of the pages kept, 1-based
+};
+
+bool ParsePageRange( const string &spec, int pageCount, vector<int> &numbers )
+// "3-5,10,12-": pages and ranges counted from 1, an open range runs to the
+// last page. Pages past the end of the document are ignored.
+{
+    set<int> pages;
+    istringstream parts(spec);
+    string part;
+    while ( getline(parts, part, ',') )
+    {
+        size_t dash = part.find('-');
+        string first = part.substr(0, dash);
+        string last = (dash == string::npos) ? first : part.substr(dash + 1);
+        if ( first.empty() || (first.find_first_not_of("0123456789") != string::npos)
+             || (last.find_first_not_of("0123456789") != string::npos) )
+            return false;
+        int from = atoi(first.c_str());
+        int to = last.empty() ? pageCount : atoi(last.c_str());
+        if ( (from < 1) || (!last.empty() && (to < from)) )
+            return false;
+        for ( int page = from; page <= min(to, pageCount); ++page )
+            pages.insert(page);
+    }
+    numbers.assign(pages.begin(), pages.end());
+    return !spec.empty();
+}
+
+PdfMemDocument &InputDocument( unique_ptr<PdfMemDocument> &pdf, const char *filename, PAGE_RANGE &range,
+                               vector<PdfReference> *colorRefs = NULL )
+// The input is parsed at most once per run, by whatever needs it first. Pages
+// outside the range leave the page tree before anything looks at them, their
+// content is never decoded. Outlines, destinations, actions and links may
+// still name them, so their page objects leave the document too: those
+// references become null and the writer does not reach their content.
+// colorRefs gets the color spaces of all pages, before any leaves, when this
+// call parses the input.
+// PoDoFo inflates and parses the object streams of the input one after
+// another while it loads, that part of the run is serial.
+{
+    if (pdf)
+        return *pdf;
+    pdf.reset( new PdfMemDocument(filename) );
+    if (colorRefs)
+        *colorRefs = GetColorRefs(*pdf);
+
+    int count = pdf->GetPageCount();
+    range.numbers.clear();
+    if (range.spec.empty())
+    {
+        for ( int page = 1; page <= count; ++page )
+            range.numbers.push_back(page);
+        return *pdf;
+    }
+    ParsePageRange( range.spec, count, range.numbers );
+    if (range.numbers.empty())
+        PODOFO_RAISE_ERROR_INFO( ePdfError_ValueOutOfRange, "--pages selects no page of the document" );
+
+    // delete runs of unselected pages from the back, so indices stay valid
+    vector<bool> keep( count + 1, false );
+    for ( int page : range.numbers )
+        keep[page] = true;
+    vector<PdfReference> deleted;
+    for ( int last = count; last >= 1; )
+    {
+        if (keep[last])
+        {
+            --last;
+            continue;
+        }
+        int first = last;
+        while ( (first > 1) && !keep[first - 1] )
+            --first;
+        for ( int page = first; page <= last; ++page )
+            deleted.push_back( pdf->GetPage(page - 1)->GetObject()->Reference() );
+        pdf->DeletePages( first - 1, last - first + 1 );
+        last = first - 1;
+    }
+    for ( const PdfReference &ref : deleted )
+        delete pdf->GetObjects().RemoveObject( ref );
+    return *pdf;
+}
+
+void ListSpotUsage( PdfMemDocument &pdf, const PAGE_RANGE &range, const vector<SPOT> &spotsList, ostream &log )
+// Inventory only run of the rewrite kernel: the pages each spot is painted on
+{
+    vector<PLATE*> no_plates;
+    vector<SPOT> no_selection;
+    PlateRouter router( no_plates, no_selection );
+    map<string, vector<int>> pages;
+    for( int page_num = 0; page_num < pdf.GetPageCount(); page_num++ )
+    {
+        vector<CONTENT_SOURCE> sources;
+        PageSources( pdf.GetPage(page_num), sources );
+        InventoryPolicy inventory;
+        ContentReader reader( sources );
+        RewritePage( reader, NULL, NULL, NULL, router, inventory, [](bool) {} );
+        for ( const string &cs : inventory.painted )
+            pages[cs].push_back(range.numbers[page_num]);
+    }
+
+    for ( const SPOT &sp : spotsList )
+    {
+        log << "  " << sp.name << ":";
+        if (pages[sp.csId].empty())
+            log << " not painted";
+        for ( int page : pages[sp.csId] )
+            log << " " << page;
+        log << endl;
+    }
+}
+
+void ReportTints( const vector<PLATE*> &plates, ostream &log )
+// The paths painted on each spot and process plate by tint, zero tint paths
+// included. Those dropped did not reach the plate.
+{
+    log << "Tint values of painted paths:" << endl;
+    for ( const PLATE *plate : plates )
+    {
+        if (plate->kind == PLATE_REMAINING)
+            continue;
+        const TINT_HISTOGRAM &tints = plate->tints;
+        log << "  " << plate->name << ":";
+        bool painted = false;
+        for ( size_t b = 0; b < 11; ++b )
+        {
+            if (tints.counts[b] == 0)
+                continue;
+            log << (painted ? ", " : " ");
+            if (b == 0)
+                log << "0% " << tints.counts[b] << " (" << tints.dropped << " dropped)";
+            else
+                log << "to " << b * 10 << "% " << tints.counts[b];
+            painted = true;
+        }
+        log << (painted ? "" : " none") << endl;
+    }
+}
+
+class ChunkView
+// Narrows the document to the pages of one --split chunk while its plates are
+// written. The catalog and a page tree of their own list only these pages.
+// Page entries that lead to other pages, the parent, annotations, article
+// beads and actions, and the catalog's outlines, names and forms are set
+// aside until the view goes away.
+{
+public:
+    ChunkView( PdfMemDocument &pdf, int first, int count )
+        : m_pdf(pdf), m_catalog(pdf.GetCatalog()->GetDictionary())
+    {
+        PdfObject *tree = pdf.GetObjects().CreateObject("Pages");
+        m_tree = tree->Reference();
+        PdfArray kids;
+        for( int page_num = first; page_num < first + count; page_num++ )
+        {
+            PdfPage *pPage = pdf.GetPage( page_num );
+            PAGE_ENTRIES page;
+            page.object = pPage->GetObject();
+            PdfDictionary &dict = page.object->GetDictionary();
+
+            // the new tree has nothing to inherit
+            const char *inherited[] = { "Resources", "MediaBox", "CropBox", "Rotate" };
+            for ( const char *key : inherited )
+            {
+                const PdfObject *value = pPage->GetInheritedKey( key );
+                if ( value && !dict.HasKey(key) )
+                {
+                    dict.AddKey( key, *value );
+                    page.added.push_back( key );
+                }
+            }
+            const char *aside[] = { "Parent", "Annots", "B", "AA" };
+            for ( const char *key : aside )
+            {
+                const PdfObject *value = dict.GetKey( key );
+                if (value)
+                {
+                    page.saved.AddKey( key, *value );
+                    dict.RemoveKey( key );
+                }
+            }
+            dict.AddKey( "Parent", m_tree );
+            kids.push_back( page.object->Reference() );
+            m_pages.push_back( page );
+        }
+        tree->GetDictionary().AddKey( "Kids", kids );
+        tree->GetDictionary().AddKey( "Count", PdfObject(static_cast<pdf_int64>(count)) );
+
+        PdfDictionary catalog;
+        const char *kept[] = { "Type", "Version", "Metadata", "OutputIntents", "OCProperties", "Lang" };
+        for ( const char *key : kept )
+        {
+            if (m_catalog.HasKey(key))
+                catalog.AddKey( key, *m_catalog.GetKey(key) );
+        }
+        catalog.AddKey( "Pages", m_tree );
+        pdf.GetCatalog()->GetDictionary() = catalog;
+    }
+
+    ~ChunkView()
+    {
+        m_pdf.GetCatalog()->GetDictionary() = m_catalog;
+        for ( PAGE_ENTRIES &page : m_pages )
+        {
+            PdfDictionary &dict = page.object->GetDictionary();
+            dict.RemoveKey( "Parent" );
+            for ( const PdfName &key : page.added )
+                dict.RemoveKey( key );
+            for ( const auto &entry : page.saved.GetKeys() )
+                dict.AddKey( entry.first, *entry.second );
+        }
+        delete m_pdf.GetObjects().RemoveObject( m_tree );
+    }
+
+private:
+    struct PAGE_ENTRIES {
+        PdfObject *object;
+        vector<PdfName> added;      // inherited entries copied to the page
+        PdfDictionary saved;        // entries set aside
+    };
+
+    PdfMemDocument &m_pdf;
+    PdfDictionary m_catalog;
+    PdfReference m_tree;
+    vector<PAGE_ENTRIES> m_pages;
+};
+
+void EmitChunk( PdfMemDocument &pdf, const vector<PLATE*> &plates, int first, int count,
+                const vector<PdfObject> &resources, const map<string, EXTRA_RESOURCE> &extras,
+                const PAGE_RANGE &range, const string &filename, const OUTPUT &output )
+// One file per plate for the pages first to first + count - 1. The plate name
+// gets the input page numbers, "Gold.p5-8" or "Gold.p5" for a single page.
+// Each file holds the resources its pages use, once.
+{
+    string pages = ".p" + to_string(range.numbers[first]);
+    if (count > 1)
+        pages += "-" + to_string(range.numbers[first + count - 1]);
+
+    DetachPageContents( pdf, first, count );
+    ChunkView view( pdf, first, count );
+    for ( const PLATE *plate : plates )
+    {
+        CheckStop();
+        for( int page_num = first; page_num < first + count; page_num++ )
+        {
+            SetPageContents( pdf.GetPage(page_num), plate->pages[page_num] );
+            FilterPageResources( pdf, pdf.GetPage(page_num), resources[page_num], plate->names[page_num], extras );
+        }
+        EmitPlate( pdf, filename, plate->name + pages, output, CACHE(), string() );
+    }
+}
+
+const int COVERAGE_DPI = 36;
+
+struct XOBJECT_BOX {
+    bool image;             // the unit square, a form is its /BBox under /Matrix
+    double box[4];
+    double matrix[6];
+};
+
+struct COVERAGE_PAGE {
+    int page;               // in the input, 1-based
+    double box[4];          // media box
+    unordered_map<string, XOBJECT_BOX> xobjects;
+    SPACE_TABLE spaces;
+};
+
+class CoverageRaster
+// A low resolution tint raster of one plate page. Paths are flattened to
+// polygons in raster space and filled one scanline at a time, a stroke is a
+// quadrilateral per segment. Every paint is cut to the bounding box of the
+// clip. Later paint replaces earlier paint, as it knocks out on the plate.
+{
+public:
+    struct POINT {
+        double x, y;
+    };
+    typedef vector<POINT> POLYGON;
+
+    explicit CoverageRaster( const double box[4] )
+        : m_scale(COVERAGE_DPI / 72.0), m_left(box[0]), m_bottom(box[1])
+    {
+        m_width = max( 1, static_cast<int>(ceil((box[2] - box[0]) * m_scale)) );
+        m_height = max( 1, static_cast<int>(ceil((box[3] - box[1]) * m_scale)) );
+        m_pixels.assign( static_cast<size_t>(m_width) * m_height, 0.0f );
+    }
+
+    double Scale() const { return m_scale; }
+
+    // a point in user space under ctm
+    POINT Map( const double ctm[6], double x, double y ) const
+    {
+        POINT p = { (ctm[0] * x + ctm[2] * y + ctm[4] - m_left) * m_scale,
+                    (ctm[1] * x + ctm[3] * y + ctm[5] - m_bottom) * m_scale };
+        return p;
+    }
+
+    // clip is the box the pixel centers must be in, [x0, x1) by [y0, y1)
+    void Fill( const vector<POLYGON> &polygons, bool evenOdd, float tint, const double clip[4] )
+    {
+        vector<EDGE> edges;
+        for ( const POLYGON &polygon : polygons )
+        {
+            for ( size_t i = 0; i < polygon.size(); ++i )
+            {
+                const POINT &a = polygon[i];
+                const POINT &b = polygon[(i + 1) % polygon.size()];
+                if (a.y == b.y)
+                    continue;
+                EDGE edge = (a.y < b.y) ? EDGE{ a.x, a.y, b.x, b.y, 1 } : EDGE{ b.x, b.y, a.x, a.y, -1 };
+                edges.push_back(edge);
+            }
+        }
+        if (edges.empty())
+            return;
+        sort( edges.begin(), edges.end(), []( const EDGE &a, const EDGE &b ) { return a.y0 < b.y0; } );
+        double top = 0;
+        for ( const EDGE &edge : edges )
+            top = max(top, edge.y1);
+
+        // active edges are those crossing the center of the scanline
+        vector<const EDGE*> active;
+        vector<pair<double, int>> crossings;
+        size_t next = 0;
+        int last = Clamp( min(ceil(top), ceil(clip[3] - 0.5)), m_height );
+        int first = Clamp( max(floor(edges[0].y0), ceil(clip[1] - 0.5)), m_height );
+        for ( int row = first; row < last; ++row )
+        {
+            double y = row + 0.5;
+            while ( (next < edges.size()) && (edges[next].y0 <= y) )
+                active.push_back(&edges[next++]);
+            active.erase( remove_if(active.begin(), active.end(), [y]( const EDGE *e ) { return e->y1 <= y; }),
+                          active.end() );
+            crossings.clear();
+            for ( const EDGE *e : active )
+                crossings.push_back( make_pair(e->x0 + (y - e->y0) * (e->x1 - e->x0) / (e->y1 - e->y0), e->dir) );
+            sort( crossings.begin(), crossings.end() );
+
+            int winding = 0;
+            double start = 0;
+            for ( const pair<double, int> &crossing : crossings )
+            {
+                bool inside = evenOdd ? (winding & 1) : (winding != 0);
+                winding += crossing.second;
+                bool now_inside = evenOdd ? (winding & 1) : (winding != 0);
+                if ( !inside && now_inside )
+                    start = crossing.first;
+                else if ( inside && !now_inside )
+                    FillSpan( row, max(start, clip[0]), min(crossing.first, clip[2]), tint );
+            }
+        }
+    }
+
+    // every segment as a quadrilateral of the line width, all turning the
+    // same way so that nonzero filling unites them
+    void Stroke( const vector<POLYGON> &lines, const vector<bool> &closed, double width, float tint,
+                 const double clip[4] )
+    {
+        vector<POLYGON> quads;
+        double half = max(width, 1.0) / 2;
+        for ( size_t l = 0; l < lines.size(); ++l )
+        {
+            const POLYGON &line = lines[l];
+            size_t segments = closed[l] ? line.size() : line.size() - 1;
+            for ( size_t i = 0; (line.size() > 1) && (i < segments); ++i )
+            {
+                const POINT &a = line[i];
+                const POINT &b = line[(i + 1) % line.size()];
+                double dx = b.x - a.x, dy = b.y - a.y;
+                double length = sqrt(dx * dx + dy * dy);
+                if (length == 0)
+                    continue;
+                double nx = -dy / length * half, ny = dx / length * half;
+                POLYGON quad = { { a.x + nx, a.y + ny }, { b.x + nx, b.y + ny },
+                                 { b.x - nx, b.y - ny }, { a.x - nx, a.y - ny } };
+                quads.push_back(quad);
+            }
+        }
+        Fill( quads, false, tint, clip );
+    }
+
+    // percent of the page with ink, and of full ink over the page
+    void Measure( COVERAGE &coverage ) const
+    {
+        size_t inked = 0;
+        double sum = 0;
+        for ( float tint : m_pixels )
+        {
+            inked += (tint > 0);
+            sum += tint;
+        }
+        coverage.area = 100.0 * inked / m_pixels.size();
+        coverage.tint = 100.0 * sum / m_pixels.size();
+    }
+
+private:
+    struct EDGE {
+        double x0, y0, x1, y1;      // y0 < y1
+        int dir;
+    };
+
+    // the pixels with their centers in [x0, x1). Blocks of eight with a
+    // fixed count vectorise at -O2 already, the open ended loop only at -O3.
+    void FillSpan( int row, double x0, double x1, float tint )
+    {
+        int x = Clamp( ceil(x0 - 0.5), m_width );
+        int to = Clamp( ceil(x1 - 0.5), m_width );
+        float *line = &m_pixels[static_cast<size_t>(row) * m_width];
+        for ( ; x + 8 <= to; x += 8 )
+        {
+            for ( int i = 0; i < 8; ++i )
+                line[x + i] = tint;
+        }
+        for ( ; x < to; ++x )
+            line[x] = tint;
+    }
+
+    // a pixel index within [0, limit], clamped as a double since paths far
+    // off the page do not fit an int
+    static int Clamp( double v, int limit )
+    {
+        return static_cast<int>( min(max(v, 0.0), static_cast<double>(limit)) );
+    }
+
+    double m_scale, m_left, m_bottom;
+    int m_width, m_height;
+    vector<float> m_pixels;
+};
+
+void ConcatMatrix( double ctm[6], const double m[6] )
+// ctm becomes m x ctm, as cm does
+{
+    double r[6] = { m[0] * ctm[0] + m[1] * ctm[2], m[0] * ctm[1] + m[1] * ctm[3],
+                    m[2] * ctm[0] + m[3] * ctm[2], m[2] * ctm[1] + m[3] * ctm[3],
+                    m[4] * ctm[0] + m[5] * ctm[2] + ctm[4], m[4] * ctm[1] + m[5] * ctm[3] + ctm[5] };
+    copy(r, r + 6, ctm);
+}
+
+COVERAGE MeasurePlatePage( const string &deflated, const COVERAGE_PAGE &page, PLATE *plate )
+// Interprets the content a plate has for a page: paths are filled and
+// stroked in the tint of their plate. Images and forms cover their box and
+// sh the page, in full ink. The clip is kept as its bounding box, which all
+// paint is cut to. Text is not rasterised.
+{
+    CoverageRaster raster( page.box );
+    vector<PLATE*> one( 1, plate );
+    vector<SPOT> no_selection;
+    PlateRouter router( one, no_selection );
+
+    struct GSTATE {
+        double ctm[6];
+        double lineWidth;
+        float fill, stroke;                 // tints, unknown ones are full ink
+        string fillSpace, strokeSpace;
+        double clip[4];                     // bounding box in raster space
+    };
+    GSTATE gs = { { 1, 0, 0, 1, 0, 0 }, 1, 1, 1, "DeviceGray", "DeviceGray", { -1e9, -1e9, 1e9, 1e9 } };
+    vector<GSTATE> saved;
+    auto set_tint = [&]( bool initial, const string &space, const vector<PdfVariant> &args, float &tint )
+    {
+        vector<float> tints( 1 );
+        const string &family = DeviceFamily( &page.spaces, space );
+        router.Tints( initial, family == "DeviceCMYK", family == "DeviceGray", space, family, args, tints );
+        tint = (tints[0] < 0) ? 1.0f : min( 1.0f, max(0.0f, tints[0]) );
+    };
+
+    vector<CoverageRaster::POLYGON> path;
+    vector<bool> closed;
+    bool clips = false;
+    double cx = 0, cy = 0;                  // current point in user space
+    auto line_to = [&]( double x, double y )
+    {
+        if (path.empty())
+        {
+            path.push_back(CoverageRaster::POLYGON());
+            closed.push_back(false);
+        }
+        path.back().push_back( raster.Map(gs.ctm, x, y) );
+        cx = x;
+        cy = y;
+    };
+    auto curve_to = [&]( double x1, double y1, double x2, double y2, double x3, double y3 )
+    {
+        double x0 = cx, y0 = cy;
+        CoverageRaster::POINT a = raster.Map(gs.ctm, x0, y0), d = raster.Map(gs.ctm, x3, y3);
+        int steps = min( 32, max(2, static_cast<int>(hypot(d.x - a.x, d.y - a.y) / 2)) );
+        for ( int i = 1; i <= steps; ++i )
+        {
+            double t = static_cast<double>(i) / steps, u = 1 - t;
+            line_to( u * u * u * x0 + 3 * u * u * t * x1 + 3 * u * t * t * x2 + t * t * t * x3,
+                     u * u * u * y0 + 3 * u * u * t * y1 + 3 * u * t * t * y2 + t * t * t * y3 );
+        }
+    };
+    auto cover_box = [&]( const double m[6], double llx, double lly, double urx, double ury )
+    {
+        vector<CoverageRaster::POLYGON> box( 1 );
+        box[0].push_back( raster.Map(m, llx, lly) );
+        box[0].push_back( raster.Map(m, urx, lly) );
+        box[0].push_back( raster.Map(m, urx, ury) );
+        box[0].push_back( raster.Map(m, llx, ury) );
+        raster.Fill( box, false, 1.0f, gs.clip );
+    };
+
+    vector<CONTENT_SOURCE> sources( 1 );
+    sources[0].data = deflated.data();
+    sources[0].size = deflated.size();
+    sources[0].deflated = true;
+    ContentReader reader( sources );
+    ContentSegmenter segmenter;
+    string chunk, segment;
+    vector<PdfVariant> args;
+    bool more = !deflated.empty();
+    while (more)
+    {
+        chunk.clear();
+        more = reader.Read(chunk);
+        segmenter.Append(chunk);
+        while ( segmenter.Next(segment, !more) )
+        {
+            if ( segmenter.InlineImageHeader() || segmenter.InlineImageContinued() )
+            {
+                if (segmenter.InlineImageHeader())
+                    cover_box( gs.ctm, 0, 0, 1, 1 );
+                continue;
+            }
+            PdfContentsTokenizer tokenizer( segment.data(), segment.size() );
+            EPdfContentsType t;
+            const char *kw;
+            PdfVariant var;
+            while ( tokenizer.ReadNext(t, kw, var) )
+            {
+                if (t == ePdfContentsType_Variant)
+                {
+                    args.push_back(var);
+                    continue;
+                }
+                CheckStop();
+                if (t != ePdfContentsType_Keyword)
+                    continue;
+
+                vector<double> n;
+                for ( const PdfVariant &arg : args )
+                    n.push_back( (arg.IsNumber() || arg.IsReal()) ? arg.GetReal() : 0 );
+                string op(kw);
+                bool stroke = isupper(static_cast<unsigned char>(kw[0])) != 0;
+                float &tint = stroke ? gs.stroke : gs.fill;
+                string &space = stroke ? gs.strokeSpace : gs.fillSpace;
+
+                if (op == "q")
+                    saved.push_back(gs);
+                else if ( (op == "Q") && !saved.empty() )
+                {
+                    gs = saved.back();
+                    saved.pop_back();
+                }
+                else if ( (op == "cm") && (n.size() == 6) )
+                    ConcatMatrix( gs.ctm, &n[0] );
+                else if ( (op == "w") && (n.size() == 1) )
+                    gs.lineWidth = n[0];
+                else if ( ((op == "cs") || (op == "CS")) && (args.size() == 1) && args[0].IsName() )
+                {
+                    space = args[0].GetName().GetEscapedName();
+                    set_tint( true, space, args, tint );
+                }
+                else if ( (op == "sc") || (op == "scn") || (op == "SC") || (op == "SCN") )
+                    set_tint( false, space, args, tint );
+                else if ( (op == "k") || (op == "K") || (op == "g") || (op == "G") || (op == "rg") || (op == "RG") )
+                {
+                    // these set their color space along with the color
+                    space = (op.size() == 2) ? "DeviceRGB" : ((tolower(kw[0]) == 'k') ? "DeviceCMYK" : "DeviceGray");
+                    set_tint( false, space, args, tint );
+                }
+                else if ( (op == "m") && (n.size() == 2) )
+                {
+                    path.push_back(CoverageRaster::POLYGON());
+                    closed.push_back(false);
+                    line_to( n[0], n[1] );
+                }
+                else if ( (op == "l") && (n.size() == 2) )
+                    line_to( n[0], n[1] );
+                else if ( (op == "c") && (n.size() == 6) )
+                    curve_to( n[0], n[1], n[2], n[3], n[4], n[5] );
+                else if ( (op == "v") && (n.size() == 4) )
+                    curve_to( cx, cy, n[0], n[1], n[2], n[3] );
+                else if ( (op == "y") && (n.size() == 4) )
+                    curve_to( n[0], n[1], n[2], n[3], n[2], n[3] );
+                else if ( (op == "h") && !closed.empty() )
+                    closed.back() = true;
+                else if ( (op == "re") && (n.size() == 4) )
+                {
+                    path.push_back(CoverageRaster::POLYGON());
+                    closed.push_back(true);
+                    line_to( n[0], n[1] );
+                    line_to( n[0] + n[2], n[1] );
+                    line_to( n[0] + n[2], n[1] + n[3] );
+                    line_to( n[0], n[1] + n[3] );
+                    cx = n[0];
+                    cy = n[1];
+                }
+                else if ( (op == "W") || (op == "W*") )
+                    clips = true;
+                else if ( (op == "f") || (op == "F") || (op == "f*") || (op == "B") || (op == "B*") || (op == "b")
+                          || (op == "b*") || (op == "S") || (op == "s") || (op == "n") )
+                {
+                    if ( (op == "b") || (op == "b*") || (op == "s") )
+                        closed.assign(closed.size(), true);
+                    bool even_odd = (op.size() == 2) && (op[1] == '*');
+                    if ( (op != "S") && (op != "s") && (op != "n") )
+                        raster.Fill( path, even_odd, gs.fill, gs.clip );
+                    if ( (op == "S") || (op == "s") || (op == "B") || (op == "B*") || (op == "b") || (op == "b*") )
+                    {
+                        double scale = sqrt( fabs(gs.ctm[0] * gs.ctm[3] - gs.ctm[1] * gs.ctm[2]) );
+                        raster.Stroke( path, closed, gs.lineWidth * scale * raster.Scale(), gs.stroke, gs.clip );
+                    }
+                    if (clips)
+                    {
+                        double box[4] = { 1e9, 1e9, -1e9, -1e9 };
+                        for ( const CoverageRaster::POLYGON &polygon : path )
+                        {
+                            for ( const CoverageRaster::POINT &p : polygon )
+                            {
+                                box[0] = min(box[0], p.x);
+                                box[1] = min(box[1], p.y);
+                                box[2] = max(box[2], p.x);
+                                box[3] = max(box[3], p.y);
+                            }
+                        }
+                        gs.clip[0] = max(gs.clip[0], box[0]);
+                        gs.clip[1] = max(gs.clip[1], box[1]);
+                        gs.clip[2] = min(gs.clip[2], box[2]);
+                        gs.clip[3] = min(gs.clip[3], box[3]);
+                    }
+                    path.clear();
+                    closed.clear();
+                    clips = false;
+                }
+                else if (op == "sh")
+                {
+                    // default user space is the page
+                    double identity[6] = { 1, 0, 0, 1, 0, 0 };
+                    cover_box( identity, page.box[0], page.box[1], page.box[2], page.box[3] );
+                }
+                else if ( (op == "Do") && (args.size() == 1) && args[0].IsName() )
+                {
+                    unordered_map<string, XOBJECT_BOX>::const_iterator it
+                        = page.xobjects.find( args[0].GetName().GetEscapedName() );
+                    if ( (it != page.xobjects.end()) && it->second.image )
+                        cover_box( gs.ctm, 0, 0, 1, 1 );
+                    else if (it != page.xobjects.end())
+                    {
+                        double m[6];
+                        copy(it->second.matrix, it->second.matrix + 6, m);
+                        ConcatMatrix( m, gs.ctm );
+                        const double *box = it->second.box;
+                        cover_box( m, box[0], box[1], box[2], box[3] );
+                    }
+                }
+                else if (op == "EI")
+                    cover_box( gs.ctm, 0, 0, 1, 1 );
+                args.clear();
+            }
+        }
+    }
+
+    COVERAGE coverage;
+    coverage.page = page.page;
+    raster.Measure( coverage );
+    return coverage;
+}
+
+bool ReadNumbers( const PdfObject *array, double *values, size_t count )
+{
+    if ( (array == NULL) || !array->IsArray() || (array->GetArray().GetSize() != count) )
+        return false;
+    for ( size_t i = 0; i < count; ++i )
+    {
+        const PdfObject &value = array->GetArray()[i];
+        if ( !value.IsNumber() && !value.IsReal() )
+            return false;
+        values[i] = value.GetReal();
+    }
+    return true;
+}
+
+void MeasureCoverage( PdfMemDocument &pdf, const vector<PLATE*> &plates, const PAGE_RANGE &range,
+                      const vector<PdfObject> &resources, const CACHE &cache )
+// Rasterises every page of every plate, in parallel. The document is only
+// read here, before the workers start. The page resources are the original
+// ones, --split may have filtered those of the pages.
+{
+    vector<COVERAGE_PAGE> pages( pdf.GetPageCount() );
+    DeviceFamilies families( pdf );
+    for ( int page_num = 0; page_num < pdf.GetPageCount(); page_num++ )
+    {
+        PdfPage *pPage = pdf.GetPage( page_num );
+        COVERAGE_PAGE &page = pages[page_num];
+        page.page = range.numbers[page_num];
+        PdfRect media = pPage->GetMediaBox();
+        page.box[0] = media.GetLeft();
+        page.box[1] = media.GetBottom();
+        page.box[2] = media.GetLeft() + media.GetWidth();
+        page.box[3] = media.GetBottom() + media.GetHeight();
+
+        const PdfObject &res = resources[page_num];
+        families.Resources( &res, page.spaces );
+        const PdfObject *xobjects = res.IsDictionary() ? res.GetDictionary().GetKey( "XObject" ) : NULL;
+        if ( xobjects && xobjects->IsReference() )
+            xobjects = pdf.GetObjects().GetObject( xobjects->GetReference() );
+        if ( (xobjects == NULL) || !xobjects->IsDictionary() )
+            continue;
+        for ( const auto &entry : xobjects->GetDictionary().GetKeys() )
+        {
+            PdfObject *xobject = entry.second;
+            if (xobject->IsReference())
+                xobject = pdf.GetObjects().GetObject( xobject->GetReference() );
+            if ( (xobject == NULL) || !xobject->IsDictionary() )
+                continue;
+            const PdfObject *subtype = xobject->GetDictionary().GetKey( PdfName::KeySubtype );
+            XOBJECT_BOX box = { true, { 0, 0, 1, 1 }, { 1, 0, 0, 1, 0, 0 } };
+            if ( subtype && subtype->IsName() && (subtype->GetName() == PdfName("Form")) )
+            {
+                box.image = false;
+                if ( !ReadNumbers(xobject->GetDictionary().GetKey("BBox"), box.box, 4) )
+                    continue;
+                ReadNumbers( xobject->GetDictionary().GetKey("Matrix"), box.matrix, 6 );
+            }
+            page.xobjects[entry.first.GetEscapedName()] = box;
+        }
+    }
+
+    for ( PLATE *plate : plates )
+        plate->coverage.assign( pages.size(), COVERAGE() );
+    size_t tasks = plates.size() * pages.size();
+    atomic<size_t> next(0);
+    mutex failed;
+    exception_ptr error;
+    auto worker = [&]()
+    {
+        for ( size_t i = next++; i < tasks; i = next++ )
+        {
+            PLATE *plate = plates[i / pages.size()];
+            size_t page_num = i % pages.size();
+            // the raster and the chunks inflated
+            const double *box = pages[page_num].box;
+            double pixels = (box[2] - box[0]) * (box[3] - box[1]) * COVERAGE_DPI * COVERAGE_DPI / (72.0 * 72.0);
+            size_t held = memoryBudget.Acquire( static_cast<size_t>(max(pixels, 1.0)) * sizeof(float) + (2 << 20) );
+            try
+            {
+                plate->coverage[page_num] = MeasurePlatePage( plate->pages[page_num], pages[page_num], plate );
+            }
+            catch ( ... )
+            {
+                lock_guard<mutex> lock( failed );
+                if (!error)
+                    error = current_exception();
+            }
+            memoryBudget.Release( held );
+        }
+    };
+
+    size_t workers = min<size_t>(max(thread::hardware_concurrency(), 1u), tasks);
+    vector<thread> threads;
+    for ( size_t i = 1; i < workers; ++i )
+        threads.emplace_back(worker);
+    worker();
+    for ( thread &t : threads )
+        t.join();
+    if (error)
+        rethrow_exception(error);
+
+    for ( const PLATE *plate : plates )
+    {
+        if (cache.dir.empty())
+            continue;
+        ostringstream list;
+        for ( const COVERAGE &coverage : plate->coverage )
+            list << coverage.page << " " << coverage.area << " " << coverage.tint << "\n";
+        CacheStore( cache, plate->key, ".coverage", list.str().data(), list.str().size() );
+    }
+}
+
+bool LoadCoverage( const CACHE &cache, PLATE &plate )
+{
+    string list;
+    if ( cache.dir.empty() || !CacheLoad( cache, plate.key, ".coverage", list ) )
+        return false;
+    istringstream values(list);
+    COVERAGE coverage;
+    plate.coverage.clear();
+    while ( values >> coverage.page >> coverage.area >> coverage.tint )
+        plate.coverage.push_back(coverage);
+    return true;
+}
+
+void EmitCoverage( const vector<PLATE> &plates, const string &filename, const OUTPUT &output )
+// One JSON document per run, named like a plate called "coverage" with .json
+// for .pdf: per page the inked area and the tint weighted coverage of each
+// plate, in percent of the page
+{
+    ostringstream json;
+    json << fixed << setprecision(2);
+    json << "{\n  \"resolution\": " << COVERAGE_DPI << ",\n  \"pages\": [";
+    size_t count = plates.empty() ? 0 : plates[0].coverage.size();
+    for ( size_t page_num = 0; page_num < count; ++page_num )
+    {
+        json << (page_num ? "," : "") << "\n    { \"page\": " << plates[0].coverage[page_num].page
+             << ", \"plates\": [";
+        for ( size_t p = 0; p < plates.size(); ++p )
+        {
+            const COVERAGE &coverage = plates[p].coverage[page_num];
+            json << (p ? "," : "") << "\n      { \"plate\": " << JsonString(plates[p].name)
+                 << ", \"area\": " << coverage.area << ", \"tint\": " << coverage.tint << " }";
+        }
+        json << "\n    ] }";
+    }
+    json << "\n  ]\n}\n";
+
+    string name = PlateFileName( filename, "coverage", output );
+    if (iends_with(name, ".pdf"))
+        name.erase(name.size() - 4);
+    string data = json.str();
+    EmitFile( name + ".json", data.data(), data.size(), output );
+}
+
+void MakeSpotList(const char *filename, unique_ptr<PdfMemDocument> &input, PAGE_RANGE &range,
+                  vector<SPOT> &spotsList, const CACHE &cache)
+{
+    // cached inventory: one "csId<TAB>name" line per spot
+    string cached;
+    if (CacheLoad( cache, cache.inputKey, ".spots", cached ))
+    {
+        istringstream lines(cached);
+        string line;
+        while ( getline(lines, line) )
+        {
+            size_t tab = line.find('\t');
+            if (tab == string::npos)
+                continue;
+            struct SPOT el;
+            el.csId = line.substr(0, tab);
+            el.name = line.substr(tab + 1);
+            spotsList.push_back(el);
+        }
+        return;
+    }
+
+    // csIds number the color spaces of the whole document, as the resource
+    // names do, so they are counted before pages outside the range leave it.
+    // Only spots of the pages kept are listed.
+    vector<PdfReference> colorRefs;
+    PdfMemDocument &pdf = InputDocument(input, filename, range, &colorRefs);
+    vector<PdfReference> keptRefs = GetColorRefs(pdf);
+    int i=0;
+    std::vector<PdfReference>::iterator it = colorRefs.begin();
+    while ( it != colorRefs.end() )
+    {
+        if ( (std::count(keptRefs.begin(), keptRefs.end(), *it) != 0)
+             && pdf.GetObjects().GetObject(*it)->IsArray() )
+        {
+            PdfArray colorArray = pdf.GetObjects().GetObject(*it)->GetArray();
+            if ( (colorArray.GetSize() > 1)
+                 && colorArray[0].IsName()
+                 && (colorArray[0].GetName().GetEscapedName() == "Separation")
+                 && colorArray[1].IsName() )
+            {
+                struct SPOT el;
+                el.name = UnescapeName( colorArray[1].GetName().GetEscapedName() );
+                el.csId = "CS" + to_string(i);
+                spotsList.push_back(el);
+            }
+        }
+        ++it;
+        ++i;
+    }
+
+    string inventory;
+    for ( const SPOT &el : spotsList )
+        inventory += el.csId + "\t" + el.name + "\n";
+    CacheStore( cache, cache.inputKey, ".spots", inventory.data(), inventory.size() );
+}
+
+int Run( int argc, char* argv[], OUTPUT &output )
+{
+    GetOpt::GetOpt_pp cmd(argc, argv);
+
+    // must be at least one Spot
+    if (argc < 3)
+    {
+	HelpMsg();
+	return 0;
+    }
+
+    // named options first, so their values are not taken for spots
+    cmd >> GetOpt::Option('o', "output-dir", output.dir);
+    cmd >> GetOpt::Option('n', "name", output.nameTemplate, "{input}.{plate}.pdf");
+    output.toArchive = (cmd >> GetOpt::OptionPresent('t', "tar"));
+    output.compact = (cmd >> GetOpt::OptionPresent('x', "compact"));
+    output.linearize = (cmd >> GetOpt::OptionPresent('w', "linearize"));
+    output.progress = (cmd >> GetOpt::OptionPresent('P', "progress"));
+    int timeout = 0, memory_limit = 0, max_memory = 0;
+    cmd >> GetOpt::Option('T', "timeout", timeout);
+    cmd >> GetOpt::Option('M', "memory-limit", memory_limit);
+    cmd >> GetOpt::Option('m', "max-memory", max_memory);
+    CACHE cache;
+    cmd >> GetOpt::Option('c', "cache", cache.dir);
+    vector<string> requestedSpots;
+    cmd >> GetOpt::Option('s', "spots", requestedSpots);
+    bool process = (cmd >> GetOpt::OptionPresent('p', "process"));
+    bool list = (cmd >> GetOpt::OptionPresent('l', "list"));
+    bool layers = (cmd >> GetOpt::OptionPresent('L', "layers"));
+    bool coverage = (cmd >> GetOpt::OptionPresent('a', "coverage"));
+    int split = 0;
+    cmd >> GetOpt::Option('k', "split", split);
+    PAGE_RANGE range;
+    cmd >> GetOpt::Option('r', "pages", range.spec);
+
+    // logging
+    bool is_log = false;
+    if ( cmd >> GetOpt::OptionPresent('d', "debug"))
+	is_log = true;
+    PdfError::EnableDebug(is_log);
+    PdfError::EnableLogging(is_log);
+
+    // get command line input parameters
+    vector<string> options;
+    cmd >> GetOpt::GlobalOption(options);
+    if (options.empty() || ((options.size() < 2) && requestedSpots.empty() && !list))
+    {
+	HelpMsg();
+	return 0;
+    }
+
+    // stdout carries the archive, progress goes to stderr then
+    ostream &log = output.toArchive ? cerr : cout;
+
+    vector<int> no_pages;
+    if ( !range.spec.empty() && !ParsePageRange(range.spec, 0, no_pages) )
+    {
+        log << "Invalid page range: " << range.spec << endl;
+        return 1;
+    }
+    if ( (split < 0) || (split && layers) )
+    {
+        log << (layers ? "--split does not go with --layers" : "Invalid split size") << endl;
+        return 1;
+    }
+    if (output.nameTemplate.find("{plate}") == string::npos)
+    {
+        log << "--name needs {plate}, or all plates get the same name" << endl;
+        return 1;
+    }
+    if ( output.linearize && output.compact )
+    {
+        log << "--linearize does not go with --compact" << endl;
+        return 1;
+    }
+    if ( (timeout < 0) || (memory_limit < 0) || (max_memory < 0) )
+    {
+        log << "Invalid " << ((timeout < 0) ? "timeout" : "memory limit") << endl;
+        return 1;
+    }
+    memoryBudget.SetLimit( static_cast<size_t>(max_memory) << 20 );
+
+    // SIGINT and SIGTERM stop the run at the next cancellation point, a
+    // second one ends it at once
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = RequestStop;
+    stop.sa_flags = SA_RESETHAND | SA_RESTART;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    if (timeout)
+    {
+        sigaction(SIGALRM, &stop, NULL);
+        alarm(timeout);
+    }
+    if (memory_limit)
+    {
+        // allocations beyond the limit fail, and so does the run. RLIMIT_DATA
+        // counts the heap and other private writable memory; RLIMIT_AS would
+        // also count the arenas each thread reserves, and the plate files,
+        // which are mapped shared and written through the page cache.
+        // Linux before 4.7 only counts the brk heap.
+        struct rlimit limit;
+        limit.rlim_cur = limit.rlim_max = static_cast<rlim_t>(memory_limit) << 20;
+        if (setrlimit(RLIMIT_DATA, &limit) != 0)
+        {
+            log << "Cannot set the memory limit" << endl;
+            return 1;
+        }
+    }
+
+    // STEP 1. Make list of all available spots
+    // load input PDF file
+    log << "Preparing..." << endl;
+    if (!cache.dir.empty())
+    {
+        // hashed through a fixed buffer, the input is never held whole
+        ifstream in( options[0].c_str(), ios::binary );
+        Sha256 hash;
+        hash.Update( PDFSE_VERSION + '\0' + range.spec + '\0' );
+        vector<char> buffer( 1 << 20 );
+        while ( in.read(buffer.data(), buffer.size()) || (in.gcount() > 0) )
+            hash.Update( buffer.data(), in.gcount() );
+        cache.inputKey = hash.Final();
+    }
+    unique_ptr<PdfMemDocument> pdf;
+    vector<SPOT> spotsList;
+    MakeSpotList(options[0].c_str(), pdf, range, spotsList, cache);
+    if (list)
+    {
+        log << "Spots and the pages they are painted on:" << endl;
+        ListSpotUsage(InputDocument(pdf, options[0].c_str(), range), range, spotsList, log);
+        return 0;
+    }
+    // get all spots from input parameters
+    vector<SPOT> spotsRemove;
+    requestedSpots.insert(requestedSpots.end(), options.begin() + 1, options.end());
+    SelectSpots(spotsList, requestedSpots, spotsRemove, log);
+    if (process)
+    {
+        // a Separation of a process colorant paints on that process plate
+        for ( size_t i = 0; i < spotsRemove.size(); )
+        {
+            if (find(PROCESS_NAMES, PROCESS_NAMES + 4, spotsRemove[i].name) == PROCESS_NAMES + 4)
+            {
+                ++i;
+                continue;
+            }
+            log << "  " << spotsRemove[i].name << " goes on the process plate of that name" << endl;
+            spotsRemove.erase(spotsRemove.begin() + i);
+        }
+    }
+
+    // STEP 2. All plates come from one pass over the pages: the selected
+    // spots, the process colors if requested and the remaining plate
+    const char *filename = options[0].c_str();
+    vector<PLATE> plates;
+    for ( const SPOT &sp : spotsRemove )
+    {
+        PLATE plate;
+        plate.kind = PLATE_SPOT;
+        plate.spot = sp;
+        plate.name = sp.name;
+        plates.push_back(plate);
+    }
+    for ( int channel = 0; process && (channel < 4); ++channel )
+    {
+        PLATE plate;
+        plate.kind = PLATE_PROCESS;
+        plate.channel = channel;
+        plate.name = PROCESS_NAMES[channel];
+        plates.push_back(plate);
+    }
+    {
+        // STEP 3. Create "<*>.remaining.pdf" file
+        PLATE plate;
+        plate.kind = PLATE_REMAINING;
+        plate.name = "remaining";
+        plates.push_back(plate);
+    }
+
+    // no two files may get the same name, a spot named "remaining" would
+    // overwrite that plate
+    {
+        vector<string> kinds;
+        if (layers)
+            kinds.push_back("layers");
+        else
+        {
+            for ( const PLATE &plate : plates )
+                kinds.push_back(plate.name);
+        }
+        set<string> names;
+        if (coverage)
+        {
+            string name = PlateFileName( filename, "coverage", output );
+            names.insert( (iends_with(name, ".pdf") ? name.substr(0, name.size() - 4) : name) + ".json" );
+        }
+        for ( const string &kind : kinds )
+        {
+            string name = PlateFileName( filename, kind, output );
+            if (!names.insert(name).second)
+            {
+                log << "Two files would be named " << name << ", choose other spots or --name" << endl;
+                return 1;
+            }
+        }
+    }
+
+    // the layered file needs the pages of every plate, only it is cached whole.
+    // Split plates are not, their pages are.
+    vector<PLATE*> pending;
+    string layers_key;
+    for ( PLATE &plate : plates )
+    {
+        if (!cache.dir.empty())
+        {
+            plate.key = PlateCacheKey( cache, plate.kind, plate.name, plate.spot.csId, spotsRemove );
+            layers_key += plate.key + "\n";
+            if ( !layers && !split && CacheLoad( cache, PlateFileKey(plate.key, output), ".pdf", plate.cached )
+                 && (!coverage || LoadCoverage( cache, plate )) )
+                continue;
+            plate.cached.clear();
+        }
+        pending.push_back(&plate);
+    }
+    if (!cache.dir.empty())
+        layers_key = Sha256Hex( "layers\n" + layers_key );
+
+    log << "Creating files for selected spots..." << endl;
+    string plate_names;
+    for ( const PLATE &plate : plates )
+    {
+        log << "  " << plate.name << endl;
+        plate_names += (plate_names.empty() ? "" : ", ") + JsonString(plate.name);
+    }
+    Progress( output, "start", "\"input\": " + JsonString(filename) + ", \"plates\": [" + plate_names + "]" );
+
+    string layered;
+    bool layered_cached = layers && CacheLoad( cache, PlateFileKey(layers_key, output), ".pdf", layered );
+    for ( PLATE &plate : plates )
+        layered_cached = layered_cached && (!coverage || LoadCoverage( cache, plate ));
+    if (layered_cached)
+    {
+        EmitPlateBytes( layered.data(), layered.size(), filename, "layers", output );
+        pending.clear();
+    }
+
+    map<string, EXTRA_RESOURCE> extras;
+    vector<PdfObject> resources;
+    if (!pending.empty())
+    {
+        // load input PDF file, unless the inventory already did
+        InputDocument( pdf, filename, range );
+        if ( (split || output.linearize) && pdf->GetEncrypted() )
+        {
+            // encrypted plates are left to PoDoFo's writer, it writes every
+            // object of the document as it is
+            log << (split ? "--split" : "--linearize") << " does not go with encrypted input" << endl;
+            return 1;
+        }
+
+        if (memoryBudget.Limit())
+        {
+            // the parsed document stays for the whole run: its stream data,
+            // about the size of the file, and the objects the xref lists
+            struct stat input;
+            size_t document = (stat(filename, &input) == 0) ? input.st_size : 0;
+            document += pdf->GetObjects().GetSize() * 256;
+            memoryBudget.Reserve( document );
+            if (document >= memoryBudget.Limit())
+                log << "The document takes about " << (document >> 20) << " MB of --max-memory, "
+                    << "its pages are separated one at a time" << endl;
+        }
+
+        // each plate filters the original resources of the pages
+        for( int page_num = 0; page_num < pdf->GetPageCount(); page_num++ )
+        {
+            PdfObject *res = pdf->GetPage(page_num)->GetResources();
+            resources.push_back( res ? *res : PdfObject(PdfVariant()) );
+        }
+
+        // split files are written as soon as the plates of their pages are done
+        int written = 0, reported = 0;
+        function<void(int)> pages_done;
+        if ( split || output.progress )
+            pages_done = [&](int done)
+            {
+                int count = pdf->GetPageCount();
+                for ( ; reported < done; ++reported )
+                {
+                    Progress( output, "page", "\"page\": " + to_string(range.numbers[reported]) + ", \"done\": "
+                              + to_string(reported + 1) + ", \"pages\": " + to_string(count) );
+                }
+                while ( split && (written < done) && ((done - written >= split) || (done == count)) )
+                {
+                    int pages = min(split, count - written);
+                    EmitChunk( *pdf, pending, written, pages, resources, extras, range, filename, output );
+                    for( int page_num = written; !coverage && (page_num < written + pages); page_num++ )
+                    {
+                        for ( PLATE *plate : pending )
+                        {
+                            memoryBudget.Unreserve( plate->pages[page_num].size() );
+                            string().swap(plate->pages[page_num]);
+                        }
+                    }
+                    written += pages;
+                }
+            };
+        SeparatePages( *pdf, pending, spotsRemove, cache, extras, pages_done );
+        if (!split)
+            MergePageContents( *pdf );
+        ReportTints( pending, log );
+        if (coverage)
+            MeasureCoverage( *pdf, pending, range, resources, cache );
+    }
+    if (coverage)
+        EmitCoverage( plates, filename, output );
+    if ( layered_cached || split )
+    {
+        for ( PLATE &plate : plates )
+            ReleasePages( plate );
+        plates.clear();
+    }
+
+    if ( layers && !pending.empty() )
+    {
+        // the layers take the pages into the document until it is written
+        size_t layered_pages = 0;
+        for ( const PLATE &plate : plates )
+            layered_pages += PagesSize( plate );
+        LayerPages( *pdf, plates, resources, extras );
+        EmitPlate( *pdf, filename, "layers", output, cache, layers_key );
+        memoryBudget.Unreserve( layered_pages );
+        plates.clear();
+    }
+
+    for ( PLATE &plate : plates )
+    {
+        CheckStop();
+        if (!plate.cached.empty())
+        {
+            EmitPlateBytes( plate.cached.data(), plate.cached.size(), filename, plate.name, output );
+            continue;
+        }
+        for( int page_num = 0; page_num < pdf->GetPageCount(); page_num++ )
+        {
+            SetPageContents( pdf->GetPage(page_num), plate.pages[page_num] );
+            FilterPageResources( *pdf, pdf->GetPage(page_num), resources[page_num], plate.names[page_num], extras );
+        }
+        ReleasePages( plate );
+        EmitPlate( *pdf, filename, plate.name, output, cache, plate.key );
+    }
+
+    if (output.toArchive)
+        FinishTar( cout );
+
+    log << "Done." << endl;
+    Progress( output, "done" );
+
+    return 0;
+}
+
+int main( int argc, char* argv[] )
+// Failures end the run with a message: exit code 1 for errors, 124 when the
+// time limit is reached and 128 plus the signal when it was cancelled
+{
+    OUTPUT output;
+    output.progress = false;
+    string reason, message;
+    int code = 1;
+    try
+    {
+        return Run( argc, argv, output );
+    }
+    catch ( const JobStopped &stopped )
+    {
+        reason = (stopped.sig == SIGALRM) ? "timeout" : "cancelled";
+        message = stopped.what();
+        code = (stopped.sig == SIGALRM) ? 124 : 128 + stopped.sig;
+    }
+    catch ( const bad_alloc & )
+    {
+        reason = "memory";
+        message = "out of memory";
+    }
+    catch ( const PdfError &error )
+    {
+        reason = (error.GetError() == ePdfError_OutOfMemory) ? "memory" : "error";
+        message = PdfError::ErrorName( error.GetError() );
+        const TDequeErrorInfo &info = error.GetCallstack();
+        if ( !info.empty() && !info.front().GetInformation().empty() )
+            message += ": " + info.front().GetInformation();
+    }
+    catch ( const exception &error )
+    {
+        reason = "error";
+        message = error.what();
+    }
+    cerr << "Error: " << message << endl;
+    Progress( output, "error", "\"reason\": \"" + reason + "\", \"message\": " + JsonString(message) );
+    return code;
 }
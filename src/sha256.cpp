@@ -0,0 +1,110 @@
+// Plain SHA-256 (FIPS 180-4), used for the content addressed cache keys
+
+#include "sha256.h"
+
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+const uint32_t H0[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+inline uint32_t Rotr( uint32_t x, int n )
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+}
+
+Sha256::Sha256()
+    : m_used(0), m_length(0)
+{
+    memcpy(m_h, H0, sizeof(m_h));
+}
+
+void Sha256::Update( const void *data, size_t size )
+// Full blocks are hashed straight from the data, only a partial block is copied
+{
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    m_length += size;
+    if (m_used)
+    {
+        size_t n = (size < 64 - m_used) ? size : 64 - m_used;
+        memcpy(m_block + m_used, p, n);
+        m_used += n;
+        p += n;
+        size -= n;
+        if (m_used < 64)
+            return;
+        Block(m_block);
+        m_used = 0;
+    }
+    for ( ; size >= 64; p += 64, size -= 64 )
+        Block(p);
+    memcpy(m_block, p, size);
+    m_used = size;
+}
+
+std::string Sha256::Final()
+{
+    // 0x80, zeros up to 56 bytes of a block, then the length in bits
+    uint64_t bits = m_length * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t zeros = (m_used < 56) ? 56 - m_used : 120 - m_used;
+    for ( int i = 0; i < 8; ++i )
+        pad[zeros + i] = static_cast<unsigned char>(bits >> ((7 - i) * 8));
+    Update(pad, zeros + 8);
+
+    char hex[65];
+    for ( int i = 0; i < 8; ++i )
+        snprintf(hex + i * 8, 9, "%08x", m_h[i]);
+
+    memcpy(m_h, H0, sizeof(m_h));
+    m_used = 0;
+    m_length = 0;
+    return std::string(hex, 64);
+}
+
+void Sha256::Block( const unsigned char *block )
+{
+    uint32_t w[64];
+    for ( int i = 0; i < 16; ++i )
+    {
+        const unsigned char *p = block + i * 4;
+        w[i] = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+    }
+    for ( int i = 16; i < 64; ++i )
+    {
+        uint32_t s0 = Rotr(w[i-15], 7) ^ Rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = Rotr(w[i-2], 17) ^ Rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = m_h[0], b = m_h[1], c = m_h[2], d = m_h[3], e = m_h[4], f = m_h[5], g = m_h[6], h = m_h[7];
+    for ( int i = 0; i < 64; ++i )
+    {
+        uint32_t t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        uint32_t t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    m_h[0] += a; m_h[1] += b; m_h[2] += c; m_h[3] += d;
+    m_h[4] += e; m_h[5] += f; m_h[6] += g; m_h[7] += h;
+}
+
+std::string Sha256Hex( const std::string &data )
+{
+    Sha256 hash;
+    hash.Update(data);
+    return hash.Final();
+}
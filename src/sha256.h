@@ -0,0 +1,35 @@
+// Plain SHA-256 (FIPS 180-4), used for the content addressed cache keys
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class Sha256
+// Hashes data given in any number of parts, the digest does not depend on
+// how it is cut. Only the current 64 byte block is held.
+{
+public:
+    Sha256();
+
+    void Update( const void *data, size_t size );
+    void Update( const std::string &data ) { Update(data.data(), data.size()); }
+
+    // pads the message and returns the digest as 64 lower case hex digits,
+    // the object is then ready for a new message
+    std::string Final();
+
+private:
+    void Block( const unsigned char *block );
+
+    uint32_t m_h[8];
+    unsigned char m_block[64];
+    size_t m_used;                  // bytes waiting in m_block
+    uint64_t m_length;              // message bytes so far
+};
+
+std::string Sha256Hex( const std::string &data );
+
+#endif
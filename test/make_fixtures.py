@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+# Writes the test inputs into the directory given, standard library only.
+#
+#   multipage.pdf   four pages over RedSpot, GoldSpot and a spot named Black,
+#                   color spaces named /CS0.. across the document as Illustrator does
+#   hybrid.pdf      classic cross reference table with an /XRefStm for the
+#                   objects in an object stream
+#   extends.pdf     two object streams, the second /Extends the first
+#   badxref.pdf     multipage.pdf with every offset in its table off by a few bytes
+
+import os
+import struct
+import sys
+import zlib
+
+SEPARATIONS = [
+    (b'RedSpot', b'0 1 1 0'),
+    (b'GoldSpot', b'0 0.3 0.75 0'),
+    (b'Black', b'0 0 0 1'),
+]
+
+
+def separation(name, c1):
+    return (b'[/Separation/' + name + b'/DeviceCMYK<</C0[0 0 0 0]/C1[' + c1
+            + b']/Domain[0 1]/FunctionType 2/N 1/Range[0 1 0 1 0 1 0 1]>>]')
+
+
+def stream(dict_, data, compress=True):
+    if compress:
+        data = zlib.compress(data)
+        dict_ += b'/Filter/FlateDecode'
+    return b'<<' + dict_ + b'/Length %d>>stream\n' % len(data) + data + b'\nendstream'
+
+
+def page_objects():
+    # 1 catalog, 2 pages, 3 font, 4-6 separations, 7-14 page and content
+    # pairs, 15 and 16 shadings, 17 a tint transform
+    paint = [
+        # page 1: RedSpot only
+        ([0], b'/CS0 cs 1 scn 10 10 100 100 re f\n'),
+        # page 2: GoldSpot, process black and a CMYK shading
+        ([1], b'/CS1 cs 0.5 scn 20 20 80 80 re f\n0 0 0 1 k 50 50 20 20 re f\n'
+              b'q 100 100 100 100 re W n /Sh0 sh Q\n'),
+        # page 3: RedSpot and the spot Black, numbered /CS2 across the document,
+        # and a shading over RedSpot and GoldSpot
+        ([0, 2], b'/CS2 CS 1 SCN 4 w 10 10 m 150 150 l S\n/CS0 cs 0.8 scn 60 60 50 50 re f\n'
+                 b'q 0 100 100 100 re W n /Sh1 sh Q\n'),
+        # page 4: GoldSpot, Black, process cyan and text in process black
+        ([1, 2], b'1 0 0 0 k 0 0 200 30 re f\n/CS1 cs 1 scn 30 100 40 40 re f\n'
+                 b'0 0 0 1 k BT /F1 12 Tf 20 180 Td (pdfse) Tj ET\n/CS2 cs 1 scn 120 120 30 30 re f\n'),
+    ]
+    objects = {
+        1: b'<</Type/Catalog/Pages 2 0 R>>',
+        3: b'<</Type/Font/Subtype/Type1/BaseFont/Helvetica>>',
+    }
+    for i, (name, c1) in enumerate(SEPARATIONS):
+        objects[4 + i] = separation(name, c1)
+    objects[15] = (b'<</ShadingType 2/ColorSpace/DeviceCMYK/Coords[100 100 200 200]'
+                   b'/Function<</FunctionType 2/Domain[0 1]/C0[0 0 0 0]/C1[1 1 0 0]/N 1>>>>')
+    objects[16] = (b'<</ShadingType 2/ColorSpace[/DeviceN[/RedSpot/GoldSpot]/DeviceCMYK 17 0 R]'
+                   b'/Coords[0 100 100 200]/Function<</FunctionType 2/Domain[0 1]/C0[1 0]/C1[0 1]/N 1>>>>')
+    objects[17] = stream(b'/FunctionType 4/Domain[0 1 0 1]/Range[0 1 0 1 0 1 0 1]',
+                         b'{ 2 copy 0.3 mul add 1 min 3 1 roll 0.75 mul add 1 min 0 3 1 roll 0 }')
+    kids = []
+    for n, (spaces, content) in enumerate(paint):
+        num = 7 + 2 * n
+        kids.append(b'%d 0 R' % num)
+        cs = b''.join(b'/CS%d %d 0 R' % (s, 4 + s) for s in spaces)
+        objects[num] = (b'<</Type/Page/Parent 2 0 R/MediaBox[0 0 200 200]/Contents %d 0 R'
+                        b'/Resources<</ColorSpace<<' % (num + 1) + cs + b'>>/Font<</F1 3 0 R>>'
+                        b'/Shading<</Sh0 15 0 R/Sh1 16 0 R>>>>>>')
+        objects[num + 1] = stream(b'', content)
+    objects[2] = b'<</Type/Pages/Kids[' + b' '.join(kids) + b']/Count %d>>' % len(kids)
+    return objects
+
+
+def classic(objects, shift=0):
+    out = bytearray(b'%PDF-1.4\n%\xe2\xe3\xcf\xd3\n')
+    offsets = {}
+    for num in sorted(objects):
+        offsets[num] = len(out)
+        out += b'%d 0 obj\n' % num + objects[num] + b'\nendobj\n'
+    size = max(objects) + 1
+    xref = len(out)
+    out += b'xref\n0 %d\n0000000000 65535 f\r\n' % size
+    for num in range(1, size):
+        if num in offsets:
+            out += b'%010d 00000 n\r\n' % (offsets[num] + shift)
+        else:
+            out += b'0000000000 65535 f\r\n'
+    out += b'trailer\n<</Size %d/Root 1 0 R>>\nstartxref\n%d\n%%%%EOF\n' % (size, xref)
+    return bytes(out)
+
+
+def object_stream(objects, nums, extends=None):
+    header, body = [], bytearray()
+    for num in nums:
+        header.append(b'%d %d' % (num, len(body)))
+        body += objects[num] + b'\n'
+    head = b' '.join(header) + b'\n'
+    dict_ = b'/Type/ObjStm/N %d/First %d' % (len(nums), len(head))
+    if extends:
+        dict_ += b'/Extends %d 0 R' % extends
+    return stream(dict_, head + bytes(body))
+
+
+def xref_stream(rows, size, extra):
+    data = b''.join(struct.pack('>BIH', *row) for row in rows)
+    return stream(b'/Type/XRef/Size %d/W[1 4 2]' % size + extra, data)
+
+
+def compressed(objects, streams, hybrid):
+    # streams: list of (stream number, object numbers, extends)
+    packed = {}
+    for snum, nums, extends in streams:
+        objects[snum] = object_stream(objects, nums, extends)
+        for i, num in enumerate(nums):
+            packed[num] = (snum, i)
+    out = bytearray(b'%PDF-1.5\n%\xe2\xe3\xcf\xd3\n')
+    offsets = {}
+    for num in sorted(objects):
+        if num in packed:
+            continue
+        offsets[num] = len(out)
+        out += b'%d 0 obj\n' % num + objects[num] + b'\nendobj\n'
+    xnum = max(objects) + 1
+    size = xnum + 1
+    rows = []
+    for num in range(size):
+        if num in packed:
+            rows.append((2, packed[num][0], packed[num][1]))
+        elif num in offsets and not hybrid:
+            rows.append((1, offsets[num], 0))
+        elif num == xnum:
+            rows.append((1, len(out), 0))
+        else:
+            rows.append((0, 0, 0 if num else 65535))
+    xref_pos = len(out)
+    if hybrid:
+        # the table lists the plain objects, the stream those in object streams
+        index = b' '.join(b'%d 1' % num for num in sorted(packed))
+        rows = [(2, packed[num][0], packed[num][1]) for num in sorted(packed)]
+        out += b'%d 0 obj\n' % xnum + xref_stream(rows, size, b'/Index[' + index + b']') + b'\nendobj\n'
+        table = len(out)
+        out += b'xref\n0 %d\n0000000000 65535 f\r\n' % size
+        for num in range(1, size):
+            if num in offsets or num == xnum:
+                out += b'%010d 00000 n\r\n' % (offsets[num] if num in offsets else xref_pos)
+            else:
+                out += b'0000000000 65535 f\r\n'
+        out += b'trailer\n<</Size %d/Root 1 0 R/XRefStm %d>>\nstartxref\n%d\n%%%%EOF\n' % (size, xref_pos, table)
+    else:
+        out += b'%d 0 obj\n' % xnum + xref_stream(rows, size, b'/Root 1 0 R') + b'\nendobj\n'
+        out += b'startxref\n%d\n%%%%EOF\n' % xref_pos
+    return bytes(out)
+
+
+def main(directory):
+    if not os.path.isdir(directory):
+        os.makedirs(directory)
+
+    def write(name, data):
+        with open(os.path.join(directory, name), 'wb') as f:
+            f.write(data)
+
+    write('multipage.pdf', classic(page_objects()))
+    write('badxref.pdf', classic(page_objects(), shift=3))
+    write('hybrid.pdf', compressed(page_objects(), [(20, [3, 4, 5, 6], None)], hybrid=True))
+    write('extends.pdf', compressed(page_objects(), [(20, [3, 4], None), (21, [5, 6, 2], 20)], hybrid=False))
+
+
+
+if __name__ == '__main__':
+    main(sys.argv[1] if len(sys.argv) > 1 else '.')
@@ -0,0 +1,409 @@
+#!/usr/bin/env python3
+# Minimal PDF reader for the tests, standard library only.
+#
+#   pdftool.py check FILE        cross reference table or stream points at every object
+#   pdftool.py pages FILE        one digest per page of its normalised content
+#   pdftool.py content FILE N    normalised content of page N (from 1)
+#   pdftool.py layers FILE       names of the optional content groups, in order
+#   pdftool.py resources FILE N  the resources of page N, one Category/Name per line
+#   pdftool.py dump FILE         every object, streams decoded where they can be
+#
+# Objects are found by scanning the file, a later definition replaces an
+# earlier one, and objects in object streams are read too. Content is
+# normalised to one token per line with numbers in a fixed format, so
+# plates written by different layouts or versions compare equal when they
+# paint the same.
+
+import hashlib
+import re
+import sys
+import zlib
+
+WHITE = b'\x00\t\n\x0c\r '
+DELIM = b'()<>[]{}/%'
+
+
+class Ref(object):
+    def __init__(self, num, gen):
+        self.num, self.gen = num, gen
+
+    def __repr__(self):
+        return '%d %d R' % (self.num, self.gen)
+
+
+class Name(str):
+    pass
+
+
+class Op(str):
+    pass
+
+
+class Stream(object):
+    def __init__(self, dict_, data):
+        self.dict, self.raw = dict_, data
+
+
+class Lexer(object):
+    def __init__(self, data, pos=0):
+        self.data, self.pos = data, pos
+
+    def skip(self):
+        d = self.data
+        while self.pos < len(d):
+            c = d[self.pos:self.pos + 1]
+            if c in WHITE:
+                self.pos += 1
+            elif c == b'%':
+                while self.pos < len(d) and d[self.pos:self.pos + 1] not in b'\r\n':
+                    self.pos += 1
+            else:
+                break
+
+    def token(self):
+        self.skip()
+        d, p = self.data, self.pos
+        if p >= len(d):
+            return None
+        c = d[p:p + 1]
+        if c == b'(':
+            depth, q, out = 1, p + 1, bytearray()
+            while q < len(d) and depth:
+                ch = d[q:q + 1]
+                if ch == b'\\':
+                    out += d[q:q + 2]
+                    q += 2
+                    continue
+                depth += (ch == b'(') - (ch == b')')
+                if depth:
+                    out += ch
+                q += 1
+            self.pos = q
+            return bytes(b'(' + out + b')')
+        if d[p:p + 2] in (b'<<', b'>>'):
+            self.pos = p + 2
+            return d[p:p + 2]
+        if c == b'<':
+            q = d.index(b'>', p)
+            self.pos = q + 1
+            return b'<' + bytes(re.sub(rb'\s', b'', d[p + 1:q])).lower() + b'>'
+        if c in b'[]{}':
+            self.pos = p + 1
+            return c
+        q = p + 1
+        while q < len(d) and d[q:q + 1] not in WHITE and d[q:q + 1] not in DELIM:
+            q += 1
+        self.pos = q
+        return d[p:q]
+
+
+NUMBER = re.compile(rb'^[+-]?(\d+\.?\d*|\.\d+)$')
+
+
+def parse(lex, tok=None):
+    if tok is None:
+        tok = lex.token()
+    if tok is None:
+        raise ValueError('unexpected end of data')
+    if tok == b'<<':
+        result = {}
+        while True:
+            key = lex.token()
+            if key == b'>>':
+                return result
+            if key is None or not key.startswith(b'/'):
+                raise ValueError('bad dictionary key %r' % key)
+            result[key[1:].decode('latin1')] = parse(lex)
+    if tok == b'[':
+        result = []
+        while True:
+            t = lex.token()
+            if t == b']':
+                return result
+            result.append(parse(lex, t))
+    if tok.startswith(b'/'):
+        return Name(tok[1:].decode('latin1'))
+    if NUMBER.match(tok):
+        if re.match(rb'^\d+$', tok):
+            save = lex.pos
+            gen = lex.token()
+            if gen is not None and re.match(rb'^\d+$', gen):
+                r = lex.token()
+                if r == b'R':
+                    return Ref(int(tok), int(gen))
+            lex.pos = save
+            return int(tok)
+        return float(tok)
+    if tok.startswith(b'(') or tok.startswith(b'<'):
+        return tok
+    if tok in (b'true', b'false'):
+        return tok == b'true'
+    if tok == b'null':
+        return None
+    return Op(tok.decode('latin1'))
+
+
+class Pdf(object):
+    def __init__(self, path):
+        self.data = open(path, 'rb').read()
+        self.objects = {}
+        self.offsets = {}
+        for m in re.finditer(rb'(?<![0-9])(\d+)\s+(\d+)\s+obj\b', self.data):
+            num = int(m.group(1))
+            self.offsets[num] = m.start()
+            self.objects[num] = ('file', m.end())
+        for num in list(self.objects):
+            obj = self.get(num)
+            if isinstance(obj, Stream) and obj.dict.get('Type') == 'ObjStm':
+                self.read_object_stream(obj)
+        self.trailer = self.read_trailer()
+
+    def read_object(self, pos):
+        lex = Lexer(self.data, pos)
+        obj = parse(lex)
+        save = lex.pos
+        if isinstance(obj, dict) and lex.token() == b'stream':
+            p = lex.pos
+            if self.data[p:p + 2] == b'\r\n':
+                p += 2
+            elif self.data[p:p + 1] in b'\r\n':
+                p += 1
+            length = self.resolve(obj.get('Length'))
+            if not isinstance(length, int) or self.data[p + length:p + length + 20].find(b'endstream') < 0:
+                length = self.data.index(b'endstream', p) - p
+            return Stream(obj, self.data[p:p + length])
+        lex.pos = save
+        return obj
+
+    def read_object_stream(self, stream):
+        data = self.decode(stream)
+        lex = Lexer(data)
+        first = stream.dict['First']
+        pairs = [(int(lex.token()), int(lex.token())) for _ in range(stream.dict['N'])]
+        for num, off in pairs:
+            if num not in self.objects:
+                self.objects[num] = ('value', parse(Lexer(data, first + off)))
+
+    def get(self, num):
+        entry = self.objects.get(num)
+        if entry is None:
+            return None
+        if entry[0] == 'file':
+            value = self.read_object(entry[1])
+            self.objects[num] = ('value', value)
+            return value
+        return entry[1]
+
+    def resolve(self, obj):
+        seen = 0
+        while isinstance(obj, Ref) and seen < 32:
+            obj = self.get(obj.num)
+            seen += 1
+        return obj
+
+    def read_trailer(self):
+        pos = self.data.rfind(b'trailer')
+        if pos >= 0:
+            lex = Lexer(self.data, pos + 7)
+            return parse(lex)
+        for num in sorted(self.objects, reverse=True):
+            obj = self.get(num)
+            if isinstance(obj, Stream) and obj.dict.get('Type') == 'XRef':
+                return obj.dict
+        raise ValueError('no trailer')
+
+    def decode(self, stream):
+        filters = self.resolve(stream.dict.get('Filter'))
+        if filters is None:
+            filters = []
+        elif not isinstance(filters, list):
+            filters = [filters]
+        data = stream.raw
+        for f in filters:
+            if self.resolve(f) != 'FlateDecode':
+                raise ValueError('filter %s not supported' % f)
+            data = zlib.decompress(data)
+        parms = self.resolve(stream.dict.get('DecodeParms'))
+        if isinstance(parms, list):
+            parms = parms[0] if parms else None
+        if isinstance(parms, dict) and parms.get('Predictor', 1) >= 10:
+            data = unpredict(data, parms.get('Columns', 1))
+        return data
+
+    def pages(self):
+        root = self.resolve(self.trailer['Root'])
+        result = []
+
+        def walk(node, depth):
+            node = self.resolve(node)
+            if depth > 64 or not isinstance(node, dict):
+                return
+            if node.get('Type') == 'Pages' or 'Kids' in node:
+                for kid in self.resolve(node.get('Kids', [])):
+                    walk(kid, depth + 1)
+            else:
+                result.append(node)
+
+        walk(root['Pages'], 0)
+        return result
+
+    def page_content(self, page):
+        contents = self.resolve(page.get('Contents'))
+        if contents is None:
+            contents = []
+        if not isinstance(contents, list):
+            contents = [contents]
+        return b'\n'.join(self.decode(self.resolve(c)) for c in contents)
+
+
+def unpredict(data, columns):
+    out, prev, row = bytearray(), bytearray(columns), columns + 1
+    for i in range(0, len(data) - row + 1, row):
+        kind, line = data[i], bytearray(data[i + 1:i + row])
+        for j in range(columns):
+            left = line[j - 1] if j else 0
+            up = prev[j]
+            if kind == 1:
+                line[j] = (line[j] + left) & 0xff
+            elif kind == 2:
+                line[j] = (line[j] + up) & 0xff
+            elif kind == 3:
+                line[j] = (line[j] + (left + up) // 2) & 0xff
+            elif kind == 4:
+                ul = prev[j - 1] if j else 0
+                p = left + up - ul
+                pa, pb, pc = abs(p - left), abs(p - up), abs(p - ul)
+                pred = left if pa <= pb and pa <= pc else (up if pb <= pc else ul)
+                line[j] = (line[j] + pred) & 0xff
+        out += line
+        prev = line
+    return bytes(out)
+
+
+def normalise(content):
+    # one token per line, numbers with at most 4 decimals, inline image data as a digest
+    lex, out = Lexer(content), []
+    while True:
+        tok = lex.token()
+        if tok is None:
+            return '\n'.join(out) + '\n'
+        if NUMBER.match(tok):
+            value = round(float(tok), 4)
+            out.append(('%.4f' % value).rstrip('0').rstrip('.').replace('-0', '0') or '0')
+        elif tok == b'ID':
+            end = content.find(b'EI', lex.pos)
+            while end >= 0 and not (content[end - 1:end] in WHITE and content[end + 2:end + 3] in WHITE):
+                end = content.find(b'EI', end + 2)
+            if end < 0:
+                end = len(content)
+            out.append('ID <%s>' % hashlib.sha256(content[lex.pos + 1:end - 1]).hexdigest()[:16])
+            lex.pos = end
+        else:
+            out.append(tok.decode('latin1'))
+
+
+def check(pdf):
+    # every object the cross reference sections list in use is where they say
+    data, problems = pdf.data, []
+    m = list(re.finditer(rb'startxref\s+(\d+)', data))
+    if not m:
+        return ['no startxref']
+    pos = int(m[-1].group(1))
+    seen = set()
+    while pos and pos not in seen:
+        seen.add(pos)
+        if data[pos:pos + 4] == b'xref':
+            lex = Lexer(data, pos + 4)
+            while True:
+                tok = lex.token()
+                if tok == b'trailer':
+                    break
+                first, count = int(tok), int(lex.token())
+                for num in range(first, first + count):
+                    offset, gen, kind = int(lex.token()), int(lex.token()), lex.token()
+                    if kind == b'n' and not re.match(rb'%d\s+%d\s+obj' % (num, gen), data[offset:offset + 32]):
+                        problems.append('object %d is not at %d' % (num, offset))
+            trailer = parse(lex)
+        else:
+            m = re.match(rb'(\d+)\s+(\d+)\s+obj', data[pos:pos + 32])
+            if not m:
+                return problems + ['no cross reference section at %d' % pos]
+            xref = pdf.read_object(pos + m.end())
+            trailer = xref.dict
+            w = trailer['W']
+            index = trailer.get('Index', [0, trailer['Size']])
+            rows = pdf.decode(xref)
+            step, r = sum(w), 0
+            for first, count in zip(index[0::2], index[1::2]):
+                for num in range(first, first + count):
+                    row = rows[r * step:(r + 1) * step]
+                    r += 1
+                    fields, p = [], 0
+                    for width in w:
+                        fields.append(int.from_bytes(row[p:p + width], 'big') if width else (1 if not fields else 0))
+                        p += width
+                    if fields[0] == 1 and not re.match(rb'%d\s+%d\s+obj' % (num, fields[2]), data[fields[1]:fields[1] + 32]):
+                        problems.append('object %d is not at %d' % (num, fields[1]))
+                    elif fields[0] == 2 and num not in pdf.objects:
+                        problems.append('object %d is not in object stream %d' % (num, fields[1]))
+        pos = trailer.get('Prev', 0)
+    if 'Root' not in pdf.trailer or not isinstance(pdf.resolve(pdf.trailer['Root']), dict):
+        problems.append('no document catalog')
+    for n, page in enumerate(pdf.pages()):
+        try:
+            pdf.page_content(page)
+        except Exception as e:
+            problems.append('page %d: %s' % (n + 1, e))
+    return problems
+
+
+def main(argv):
+    if len(argv) < 3:
+        sys.stderr.write(open(__file__).read().split('\n\n')[0] + '\n')
+        return 2
+    command, pdf = argv[1], Pdf(argv[2])
+    if command == 'check':
+        problems = check(pdf)
+        for p in problems:
+            print('%s: %s' % (argv[2], p))
+        return 1 if problems else 0
+    if command == 'pages':
+        for page in pdf.pages():
+            print(hashlib.sha256(normalise(pdf.page_content(page)).encode('latin1')).hexdigest())
+        return 0
+    if command == 'content':
+        sys.stdout.write(normalise(pdf.page_content(pdf.pages()[int(argv[3]) - 1])))
+        return 0
+    if command == 'layers':
+        root = pdf.resolve(pdf.trailer['Root'])
+        props = pdf.resolve(root.get('OCProperties', {}))
+        for ocg in pdf.resolve(props.get('OCGs', [])):
+            name = pdf.resolve(pdf.resolve(ocg).get('Name'))
+            print(name[1:-1].decode('latin1') if isinstance(name, bytes) else name)
+        return 0
+    if command == 'resources':
+        resources = pdf.resolve(pdf.pages()[int(argv[3]) - 1].get('Resources', {}))
+        for category in sorted(resources):
+            entries = pdf.resolve(resources[category])
+            if isinstance(entries, dict):
+                for name in sorted(entries):
+                    print('%s/%s' % (category, name))
+        return 0
+    if command == 'dump':
+        for num in sorted(pdf.objects):
+            obj = pdf.get(num)
+            if isinstance(obj, Stream):
+                try:
+                    data = pdf.decode(obj)
+                except Exception:
+                    data = obj.raw
+                print('%d: %r stream\n%s\nendstream' % (num, obj.dict, data.decode('latin1')))
+            else:
+                print('%d: %r' % (num, obj))
+        return 0
+    sys.stderr.write('unknown command %s\n' % command)
+    return 2
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,190 @@
+#!/bin/bash
+# Separates test/sample.pdf and the generated inputs of make_fixtures.py with
+# each layout option, checks the structure of every file written and compares
+# the content of the plate pages, which must not depend on the layout, against
+# the default layout and against the plates of the baseline revision.
+#
+#   test/run_tests.sh [PDFSE]
+#
+# PDFSE defaults to ./pdfse, built by ./make_pdfse. BASELINE names the git
+# revision to compare with, the first commit by default; it is built with the
+# same command as make_pdfse. qpdf --check validates the files where qpdf is
+# installed, test/pdftool.py check always does.
+
+cd "$(dirname "$0")/.."
+PDFSE=$(readlink -f "${1:-./pdfse}")
+TOOL="python3 $PWD/test/pdftool.py"
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+FAILED=0
+
+fail()
+{
+    echo "FAIL: $*"
+    FAILED=1
+}
+
+# structure of every pdf in a directory
+check_dir()
+{
+    local f
+    for f in "$1"/*.pdf; do
+        [ -e "$f" ] || { fail "$2: no files written"; return; }
+        $TOOL check "$f" || fail "$2: $(basename "$f") is broken"
+        if command -v qpdf > /dev/null; then
+            qpdf --check "$f" > "$WORK/qpdf.log" 2>&1 || { cat "$WORK/qpdf.log"; fail "$2: qpdf --check $(basename "$f")"; }
+        fi
+    done
+}
+
+# page digests of one plate, the split files of a plate in page order
+digests()
+{
+    local f
+    for f in $(ls "$1"/$2 2> /dev/null | sort -V); do
+        $TOOL pages "$f"
+    done
+}
+
+# run NAME INPUT OPTIONS...: separates INPUT into $WORK/NAME
+run()
+{
+    local name=$1 input=$2
+    shift 2
+    mkdir -p "$WORK/$name"
+    "$PDFSE" "$input" -o "$WORK/$name" "$@" > "$WORK/$name.log" 2>&1
+    local status=$?
+    if [ $status -ne 0 ]; then
+        cat "$WORK/$name.log"
+        fail "$name: exit code $status"
+        return 1
+    fi
+    check_dir "$WORK/$name" "$name"
+}
+
+# same PLATE: the plate pages of two runs paint the same
+same()
+{
+    local a b
+    a=$(digests "$WORK/$1" "$3")
+    b=$(digests "$WORK/$2" "$4")
+    [ -n "$a" ] && [ "$a" = "$b" ] || fail "$2: $4 differs from $1: $3"
+}
+
+[ -x "$PDFSE" ] || { echo "No pdfse at $PDFSE, build it with ./make_pdfse"; exit 1; }
+python3 test/make_fixtures.py "$WORK/in" || exit 1
+cp test/sample.pdf "$WORK/in/"
+SPOTS="RedSpot GoldSpot"
+
+echo "SHA-256"
+g++ -O2 src/sha256.cpp test/sha256_test.cpp -o "$WORK/sha256_test" && "$WORK/sha256_test" || fail "sha256: known answers"
+
+echo "Layouts"
+run default "$WORK/in/sample.pdf" -p $SPOTS
+run compact "$WORK/in/sample.pdf" -p -x $SPOTS
+run linear "$WORK/in/sample.pdf" -p -w $SPOTS
+run split "$WORK/in/sample.pdf" -p -k 1 $SPOTS
+run layers "$WORK/in/sample.pdf" -p -L $SPOTS
+mkdir -p "$WORK/tar"
+"$PDFSE" "$WORK/in/sample.pdf" -p -t $SPOTS 2> "$WORK/tar.log" | tar -x -C "$WORK/tar" || fail "tar: archive not written"
+check_dir "$WORK/tar" tar
+for plate in RedSpot GoldSpot Cyan Magenta Yellow Black remaining; do
+    for layout in compact linear tar; do
+        same default $layout "sample.$plate.pdf" "sample.$plate.pdf"
+    done
+    same default split "sample.$plate.pdf" "sample.$plate.p*.pdf"
+done
+[ "$($TOOL layers "$WORK/layers/sample.layers.pdf" | sort | tr '\n' ' ')" = \
+  "Black Cyan GoldSpot Magenta RedSpot Yellow remaining " ] || fail "layers: not one layer per plate"
+[ "$($TOOL content "$WORK/layers/sample.layers.pdf" 1 | grep -c pdfseOverprint)" = 7 ] || fail "layers: a layer does not overprint"
+
+echo "Baseline"
+BASELINE=${BASELINE:-$(git rev-list --max-parents=0 HEAD)}
+mkdir -p "$WORK/base/src" "$WORK/baseline"
+git archive "$BASELINE" src | tar -x -C "$WORK/base"
+if g++ -O2 -pthread "$WORK/base/src/pdfse.cpp" "$WORK/base/src/getopt_pp.cpp" -lpodofo -lfreetype -lfontconfig -ljpeg -lz \
+       -o "$WORK/base/pdfse" 2> "$WORK/base.log"; then
+    cp test/sample.pdf "$WORK/baseline/"
+    (cd "$WORK/baseline" && "$WORK/base/pdfse" sample.pdf $SPOTS > "$WORK/baseline.log" 2>&1) || fail "baseline: run failed"
+    for plate in RedSpot GoldSpot remaining; do
+        same baseline default "sample.$plate.pdf" "sample.$plate.pdf"
+    done
+else
+    cat "$WORK/base.log"
+    fail "baseline: $BASELINE does not build"
+fi
+
+echo "Options"
+# spots matched by wildcard and regular expression, case folded
+run match "$WORK/in/sample.pdf" -p --spots 'redspot' 'g*SPOT' 're:^Gold'
+for plate in RedSpot GoldSpot remaining; do
+    same default match "sample.$plate.pdf" "sample.$plate.pdf"
+done
+# a second run takes the plates from the cache
+run cached1 "$WORK/in/sample.pdf" -p -c "$WORK/cache" $SPOTS
+run cached2 "$WORK/in/sample.pdf" -p -c "$WORK/cache" $SPOTS
+for plate in RedSpot GoldSpot Black remaining; do
+    same default cached1 "sample.$plate.pdf" "sample.$plate.pdf"
+    same default cached2 "sample.$plate.pdf" "sample.$plate.pdf"
+done
+"$PDFSE" "$WORK/in/sample.pdf" --pages 3-x RedSpot > /dev/null 2>&1
+[ $? -eq 1 ] || fail "pages: an invalid range is not refused"
+"$PDFSE" "$WORK/in/sample.pdf" -o "$WORK" -n out.pdf RedSpot > /dev/null 2>&1
+[ $? -eq 1 ] || fail "name: a template without {plate} is not refused"
+# braces in the input name are not expanded again
+cp test/sample.pdf "$WORK/in/{input}{plate}.pdf"
+mkdir -p "$WORK/braces"
+timeout 60 "$PDFSE" "$WORK/in/{input}{plate}.pdf" -o "$WORK/braces" RedSpot > "$WORK/braces.log" 2>&1 \
+    || fail "braces: exit code $?"
+[ -e "$WORK/braces/{input}{plate}.RedSpot.pdf" ] || fail "braces: {input}{plate}.RedSpot.pdf not written"
+
+echo "Inputs"
+run multipage "$WORK/in/multipage.pdf" $SPOTS Black
+# --pages N gives page N of a full run, for the plates of spots on page N
+for page in 1 2 3 4; do
+    run pages$page "$WORK/in/multipage.pdf" --pages $page $SPOTS Black
+    compared=0
+    for plate in RedSpot GoldSpot Black remaining; do
+        [ -e "$WORK/pages$page/multipage.$plate.pdf" ] || continue
+        a=$($TOOL pages "$WORK/multipage/multipage.$plate.pdf" | sed -n ${page}p)
+        b=$($TOOL pages "$WORK/pages$page/multipage.$plate.pdf")
+        [ -n "$a" ] && [ "$a" = "$b" ] || fail "pages$page: $plate differs from page $page of a full run"
+        compared=$((compared + 1))
+    done
+    [ $compared -ge 2 ] || fail "pages$page: plates missing"
+done
+# objects in object streams, found through an /XRefStm or an /Extends chain
+for input in hybrid extends; do
+    run $input "$WORK/in/$input.pdf" $SPOTS Black
+    for plate in RedSpot GoldSpot Black remaining; do
+        same multipage $input "multipage.$plate.pdf" "$input.$plate.pdf"
+    done
+done
+# a broken table may be rebuilt or refused, but not crash
+mkdir -p "$WORK/badxref"
+"$PDFSE" "$WORK/in/badxref.pdf" -o "$WORK/badxref" $SPOTS > "$WORK/badxref.log" 2>&1
+status=$?
+if [ $status -eq 0 ]; then
+    check_dir "$WORK/badxref" badxref
+elif [ $status -ne 1 ]; then
+    cat "$WORK/badxref.log"
+    fail "badxref: exit code $status"
+fi
+# shadings split for a plate draw the colorants it drops at zero
+run process "$WORK/in/multipage.pdf" -p $SPOTS
+$TOOL dump "$WORK/process/multipage.Cyan.pdf" | grep -q '{ 0 mul 4 1 roll 0 mul 4 1 roll 0 mul 4 1 roll 4 1 roll }' \
+    || fail "process: the CMYK shading on Cyan keeps the other channels"
+$TOOL dump "$WORK/process/multipage.RedSpot.pdf" | grep -q '{ 0 mul 2 1 roll 2 1 roll' \
+    || fail "process: the DeviceN shading on RedSpot keeps GoldSpot"
+# with -p the spot named Black paints on the process plate Black
+run black "$WORK/in/multipage.pdf" -p -L $SPOTS Black
+[ -z "$($TOOL layers "$WORK/black/multipage.layers.pdf" | sort | uniq -d)" ] || fail "black: two layers of one name"
+[ "$($TOOL layers "$WORK/black/multipage.layers.pdf" | grep -c '^Black$')" = 1 ] || fail "black: no Black layer"
+run black_plates "$WORK/in/multipage.pdf" -p $SPOTS Black
+$TOOL content "$WORK/black_plates/multipage.Black.pdf" 3 | grep -q '^SCN$' || fail "black: the spot Black is not on the Black plate"
+# only plates showing text keep the font
+[ -z "$($TOOL resources "$WORK/multipage/multipage.GoldSpot.pdf" 4 | grep '^Font/')" ] || fail "multipage: GoldSpot keeps a font"
+[ -n "$($TOOL resources "$WORK/multipage/multipage.remaining.pdf" 4 | grep '^Font/')" ] || fail "multipage: remaining lost its font"
+
+[ $FAILED -eq 0 ] && echo "All tests passed"
+exit $FAILED
@@ -0,0 +1,55 @@
+// Known answer tests of src/sha256.cpp, the messages of FIPS 180-4 examples
+//
+//   g++ src/sha256.cpp test/sha256_test.cpp -o sha256_test && ./sha256_test
+
+#include "../src/sha256.h"
+
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+int failed = 0;
+
+void Expect( const string &name, const string &digest, const string &expected )
+{
+    if (digest != expected)
+    {
+        cout << "FAIL: sha256 " << name << ": " << digest << ", expected " << expected << endl;
+        failed = 1;
+    }
+}
+
+int main()
+{
+    const string two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    const string million_a = "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0";
+
+    Expect("empty", Sha256Hex(""), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    Expect("abc", Sha256Hex("abc"), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    Expect("448 bits", Sha256Hex(two_blocks), "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    Expect("million a", Sha256Hex(string(1000000, 'a')), million_a);
+
+    // the same message cut into parts of every size around a block
+    for ( size_t part = 1; part <= 130; ++part )
+    {
+        Sha256 hash;
+        string chunk(part, 'a');
+        size_t left = 1000000;
+        for ( ; left >= part; left -= part )
+            hash.Update(chunk);
+        hash.Update(chunk.data(), left);
+        Expect("million a in parts of " + to_string(part), hash.Final(), million_a);
+    }
+
+    // a finished hash starts over
+    Sha256 hash;
+    hash.Update("xyz");
+    hash.Final();
+    hash.Update("abc");
+    Expect("reused", hash.Final(), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+    if (!failed)
+        cout << "sha256: all known answers match" << endl;
+    return failed;
+}